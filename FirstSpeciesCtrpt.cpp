@@ -10,8 +10,8 @@
 */
 
 #include "stdafx.h"
-#include <fstream> // ofstream, ifstream
-#include <iostream> // cout
+#include <fstream> // ofstream
+#include <iostream> // cout, cerr
 #include <string> 
 #include <sstream>
 #include <map>
@@ -19,12 +19,202 @@
 #include <stdlib.h> // srand, rand
 #include <time.h>
 #include <stdio.h> // NULL
+#include <limits.h> // INT_MAX, LONG_MAX
+#include <atomic>
+#include <chrono>
+#include <thread> // sleep_until
+#include <mutex>
+#include <random> // mt19937
+#include <algorithm> // shuffle
+#include <array>
+#include <functional>
+#include <math.h> // pow, round
+#include <memory> // unique_ptr
+#include <unordered_map>
 
 using namespace std;
 
-// Constants to define the range of each voice.
-const double ALTO[] = { 196.00, 698.47 };
-const double TENOR[] = { 130.81, 523.26 };
+// Constants to define the range of each voice as MIDI notes (middle C = 60).
+const int SOPRANO[] = { 60, 81 };
+const int ALTO[] = { 55, 77 };
+const int TENOR[] = { 48, 72 };
+const int BASS[] = { 40, 64 };
+// Lowest and highest MIDI notes a --voices range may use. Notes are counted from C0 (MIDI 12).
+const int MIDI_LOWEST = 12;
+const int MIDI_HIGHEST = 127;
+
+// Every tonic, spelled with sharps.
+const string KEY_NAMES[] = { "A", "A#", "B", "C", "C#", "D", "D#", "E", "F", "F#", "G", "G#" };
+
+// Pitch class (C = 0) of each note letter A - G.
+const int LETTER_PITCHES[] = { 9, 11, 0, 2, 4, 5, 7 };
+
+// A mode is its scale as semitones above the tonic for degrees I - VII, plus the semitones VII
+// is raised by at a cadence so that it leads into the tonic. Modes whose II is a half step above
+// the tonic keep their VII, as the cadence sounds II against VII and raising it would make that
+// a diminished third or an augmented sixth.
+struct Mode {
+    string name;
+    int steps[7];
+    int leadingToneRaise;
+};
+
+const int NUM_MODES = 8;
+const Mode MODES[NUM_MODES] = {
+    { "major",      { 0, 2, 4, 5, 7, 9, 11 }, 0 },
+    { "minor",      { 0, 2, 3, 5, 7, 8, 10 }, 1 },
+    { "harmonic",   { 0, 2, 3, 5, 7, 8, 11 }, 0 },
+    { "dorian",     { 0, 2, 3, 5, 7, 9, 10 }, 1 },
+    { "phrygian",   { 0, 1, 3, 5, 7, 8, 10 }, 0 },
+    { "lydian",     { 0, 2, 4, 6, 7, 9, 11 }, 0 },
+    { "mixolydian", { 0, 2, 4, 5, 7, 9, 10 }, 1 },
+    { "locrian",    { 0, 1, 3, 5, 6, 8, 10 }, 0 }
+};
+
+// Semitones in the minor or perfect form of each interval from a unison to a seventh, and which
+// of them are perfect. Major intervals are a semitone wider than minor ones.
+const int INTERVAL_SEMITONES[] = { 0, 1, 3, 5, 7, 8, 10 };
+const bool PERFECT_INTERVALS[] = { true, false, false, true, true, false, false };
+
+// A key is a tonic pitch class (C = 0, -1 for no key) and an index into MODES. degrees maps every
+// pitch class to its degree in the key (1 - 7), or 0 if it isn't in the key.
+struct MusicKey {
+    int tonic;
+    int mode;
+    int degrees[12];
+};
+
+// A tuning sets the ratio of each of the 12 semitones above the tonic to the tonic. All but just
+// intonation get them by stacking fifths of the given size. Whatever the tuning, the tonic is
+// tuned as in equal temperament from tuningA4.
+struct Tuning {
+    string name;
+    double fifth;
+};
+
+const int NUM_TUNINGS = 4;
+const Tuning TUNINGS[NUM_TUNINGS] = {
+    { "equal",       pow(2.0, 7.0 / 12) },
+    { "just",        0 },
+    { "pythagorean", 3.0 / 2 },
+    { "meantone",    pow(5.0, 0.25) }
+};
+
+// Number of fifths from the tonic to the major or perfect interval above it on each degree. Every
+// semitone the degree is raised adds seven more.
+const int DEGREE_FIFTHS[] = { 0, 2, 4, -1, 1, 3, 5 };
+
+// Number of fifths from the tonic to each semitone above it when it isn't a degree of the key,
+// from a minor third (-3) to an augmented fifth (8).
+const int FIFTHS_ABOVE_TONIC[] = { 0, 7, 2, -3, 4, -1, 6, 1, 8, 3, -2, 5 };
+
+// Five-limit just intonation ratios of each semitone above the tonic.
+const double JUST_RATIOS[] = { 1.0, 16.0 / 15, 9.0 / 8, 6.0 / 5, 5.0 / 4, 4.0 / 3, 45.0 / 32,
+    3.0 / 2, 8.0 / 5, 5.0 / 3, 9.0 / 5, 15.0 / 8 };
+
+// Index into TUNINGS used for output, and the frequency of A4 in Hz.
+int tuning = 0;
+double tuningA4 = 440;
+
+// 4/4 time, one note per beat.
+const int NOTES_PER_MEASURE = 4;
+
+// Streaming: notes that must be proven continuable past a measure before it is committed,
+// the number of cantus lines tried per measure, and the search node budget per measure.
+const int STREAM_LOOKAHEAD = 8;
+const int STREAM_CANTUS_ATTEMPTS = 8;
+const long STREAM_NODE_BUDGET = 20000;
+
+// Set by the input listener when a streaming piece should close with a cadence.
+atomic<bool> cadenceRequested(false);
+
+// Number of threads used to solve the ctrpt melody, and how many notes deep the search tree is
+// split into tasks for them.
+int solverThreads = 1;
+const int PARALLEL_SPLIT_DEPTH = 3;
+
+// Range of every voice from top to bottom when writing with the n-voice solver, which is used
+// whenever this isn't empty. The cantus is the top voice. There are default ranges for up to
+// MAX_VOICES voices.
+vector<array<int, 2> > voiceRanges;
+const int MAX_VOICES = 4;
+
+// Species and n-voice search: node budget per cantus, and how many cantus lines to try before
+// giving up.
+const long SEARCH_NODE_BUDGET = 200000;
+const int SEARCH_CANTUS_ATTEMPTS = 20;
+
+// Species of the ctrpt (1 - 4), and how many ctrpt notes each cantus note is split into for each
+// species. Fourth species ties every weak beat over into the next strong beat.
+int ctrptSpecies = 1;
+const int SPECIES_SUBDIVISIONS[] = { 1, 1, 2, 4, 2 };
+
+// Benchmark: length of each piece solved.
+const int BENCH_MEASURES = 4;
+
+// Batch: shards of the fingerprint set, the fewest attempts before the space of pieces may be
+// called exhausted, the default estimated chance of a new piece below which a batch stops early,
+// and the most attempts allowed per piece asked for.
+const int BATCH_SHARDS = 64;
+const long BATCH_MIN_ATTEMPTS = 200;
+const double BATCH_STOP_ESTIMATE = 0.001;
+const long BATCH_ATTEMPTS_PER_PIECE = 1000;
+
+// One shard of the set of pieces seen by batch mode, from fingerprint to the number of times the
+// piece was generated.
+struct FingerprintShard {
+    mutex lock;
+    unordered_map<unsigned long long, int> counts;
+};
+
+// Verification: longest piece generated, threads given to the parallel solver, the longest
+// cantus whose solutions are also counted, and the most solutions counted before giving up.
+const int VERIFY_MAX_MEASURES = 8;
+const int VERIFY_THREADS = 4;
+const unsigned VERIFY_COUNT_NOTES = 8;
+const long VERIFY_COUNT_LIMIT = 200000;
+
+// Tracing: whether spans are recorded, how many levels of the ctrpt search get a span of their own,
+// and how many spans each thread keeps before overwriting its oldest.
+bool tracingEnabled = false;
+int traceDepth = 0;
+const unsigned TRACE_BUFFER_SIZE = 65536;
+
+// A finished span. depth is how many spans were open on the thread when it started, and arg is
+// appended to the name if it isn't -1 (the search depth, for example).
+struct TraceEvent {
+    const char* name;
+    int arg;
+    int depth;
+    long long start;
+    long long end;
+};
+
+// Ring buffer of one thread's spans. Only its own thread writes to it, and buffers are never freed
+// so they can be read after their thread has finished.
+struct TraceBuffer {
+    int threadId;
+    int openSpans;
+    atomic<unsigned long long> count;
+    unique_ptr<TraceEvent[]> events;
+    TraceBuffer* next;
+};
+
+// Every thread's buffer, newest first.
+atomic<TraceBuffer*> traceBuffers(nullptr);
+atomic<int> traceThreadCount(0);
+thread_local TraceBuffer* traceBuffer = nullptr;
+const chrono::steady_clock::time_point traceEpoch = chrono::steady_clock::now();
+
+// Records the time from its construction to its destruction as a span. Does nothing but check a
+// flag when tracing is off, or when depth isn't below traceDepth.
+struct TraceSpan {
+    const char* name;
+    int arg;
+    long long start;
+    TraceSpan(const char* spanName, int depth = -1);
+    ~TraceSpan();
+};
 
 // API---------------------------------------------------------------------------------------------
 
@@ -32,44 +222,166 @@ const double TENOR[] = { 130.81, 523.26 };
 // FILE WRITING -----------------------------------------------------------------------------------
 //-------------------------------------------------------------------------------------------------
 
-ofstream startFile(string filename);
+ofstream startFile(string filename, string options = "-odac", int numVoices = 2);
 // Opens and begins writing to file. Returns ofstream for further writing.
 
 void writeMelody(ofstream& myfile);
 // Writes the cantus and ctrpt melodies to the file.
 
-vector<int> writeCantusMelody(ofstream& myfile, vector<string> musicKey, int octIndicator);
+vector<int> writeCantusMelody(ofstream& myfile, MusicKey musicKey);
 // Generates and writes cantus melody to file. Returns cantus notes for further use.
 
-void writeCtrptMelody(ofstream& myfile, vector<string> musicKey,
-    vector<int> cantusNotes, int octIndicator);
+void writeVoicesMelody(ofstream& myfile, MusicKey musicKey, vector<array<int, 2> > ranges);
+// Generates and writes a cantus and a ctrpt melody for every other voice range to file.
+
+void writeCtrptMelody(ofstream& myfile, MusicKey musicKey, vector<int> cantusNotes);
 // Generates and writes ctrpt melody to file.
 
+void writeSpeciesMelody(ofstream& myfile, MusicKey musicKey, int species);
+// Generates and writes a cantus and a second, third or fourth species ctrpt melody to file.
+
 void endFile(ofstream& myfile);
 
 //-------------------------------------------------------------------------------------------------
 // COMPOSITION ------------------------------------------------------------------------------------
 //-------------------------------------------------------------------------------------------------
 
-vector<int> fillCtrptMelody(vector<string> musicKey, vector<int> cantusNotes, int octIndicator);
-// Container function for backtrackFillCtrptMelody(). Returns finished ctrpt melody.
+vector<int> generateCantusMelody(map<int, int> notes, MusicKey musicKey, int totalNotes);
+// Randomly generates a cantus melody. Returns an empty melody on a dead end.
 
-vector<int> backtrackFillCtrptMelody(vector<int>& ctrptNotes, map<int, float> notes,
-    vector<int> cantusNotes);
-// Generates / returns ctrpt melody.
+vector<int> generateCantusMelody(map<int, int> notes, MusicKey musicKey, int totalNotes,
+    mt19937& rng);
+// Same as above, using the given generator so threads don't share rand()'s state.
+
+vector<int> generateSolvableCantus(map<int, int> notes, MusicKey musicKey, int totalNotes,
+    function<bool(vector<int>&, long&)> solve);
+// Generates cantus melodies until solve() writes the other voices against one within its node
+// budget, giving up after SEARCH_CANTUS_ATTEMPTS. Returns the cantus, or nothing on failure.
 
-vector<string> getMusicKey();
-// Reads in list of keys and returns a list of note names corresponding to the key given by user
-// input.
+vector<int> fillCtrptMelody(MusicKey musicKey, vector<int> cantusNotes);
+// Container function for backtrackFillCtrptMelody(). Returns finished ctrpt melody.
 
-map<int, float> getNotes(vector<string> musicKey, int octIndicator, const double range[]);
-// Reads in NoteFrequencies.txt and returns a map from two digit int (note position in specified
-// key & note octave) to float (corresponding frequencies).
+vector<int> backtrackFillCtrptMelody(vector<int>& ctrptNotes, map<int, int> notes,
+    MusicKey musicKey, vector<int> cantusNotes);
+// Generates / returns ctrpt melody.
 
-int notePos(string note, vector<string> musicKey, int octIndicator);
-// Converts a string (C1, A#2, etc...) to a 2-digit int specifying octave (10's place) and
-// position in musical key (1 - 7 in 1's place). OctIndicator orients the process such that
-// the octave digit increments with the tonic note.
+vector<int> parallelFillCtrptMelody(map<int, int> notes, MusicKey musicKey,
+    vector<int> cantusNotes, int numThreads);
+// Splits the ctrpt search into tasks solved by numThreads threads. Threads left without a task
+// race the others on tasks still being searched. The first thread to finish a melody wins and the
+// rest give up. Returns finished ctrpt melody.
+
+vector<int> fillSpeciesMelody(map<int, int> notes, MusicKey musicKey, vector<int> cantusNotes,
+    int species, long& budget);
+// Container function for backtrackFillSpeciesMelody(). Returns the ctrpt melody as a grid of
+// SPECIES_SUBDIVISIONS[species] notes per cantus note, followed by a single final note. Ends in -1
+// on failure.
+
+bool backtrackFillSpeciesMelody(vector<int>& grid, vector<map<int, int> >& domains,
+    MusicKey musicKey, vector<int>& cantusNotes, int species, long& budget);
+// Fills the rest of the grid in place from the notes left in each cell's domain. Returns false
+// on failure or when the budget runs out.
+
+vector<map<int, int> > getSpeciesDomains(map<int, int> notes, MusicKey musicKey,
+    vector<int> cantusNotes, int species);
+// Returns the notes every cell of the grid may take given only the cantus, pruned until every
+// note can be reached from the cell before it and can reach the cell after.
+
+void pruneDomains(vector<map<int, int> >& domains,
+    function<bool(int prevNote, int note, unsigned index)> isAllowedStep);
+// Removes notes from a melody's domains until every note can be reached from one in the domain
+// before it and can reach one in the domain after. isAllowedStep() says whether the melody may
+// move from prevNote to note at index.
+
+bool isCtrptPossible(map<int, int>& notes, MusicKey musicKey, vector<int>& cantusNotes);
+// Returns false if some ctrpt note is left with nothing to choose from once the notes the rest of
+// the melody can't join are pruned. Cheap next to an exhaustive search that finds nothing.
+
+void splitCtrptSearch(vector<int>& ctrptNotes, map<int, int>& notes, MusicKey musicKey,
+    vector<int>& cantusNotes, int depth, vector<vector<int> >& tasks);
+// Collects every allowed ctrpt melody prefix that is depth notes longer than ctrptNotes.
+
+bool backtrackFillCtrptTask(vector<int>& ctrptNotes, map<int, int>& notes, MusicKey musicKey,
+    vector<int>& cantusNotes, mt19937& rng, atomic<bool>& solved);
+// Completes ctrptNotes in place. Returns false on failure or once another task has solved the
+// melody.
+
+bool backtrackFillCtrptTask(vector<int>& ctrptNotes, map<int, int>& notes, MusicKey musicKey,
+    vector<int>& cantusNotes, mt19937& rng, atomic<bool>& solved, bool cadence, long& budget);
+// Same as above, also giving up when the budget runs out. Without a cadence the melody ends
+// mid-phrase, so only the first note gets the cadence rules' checks.
+
+vector<vector<int> > fillVoices(vector<int> cantusNotes, vector<map<int, int> > notes,
+    MusicKey musicKey, long& budget);
+// Container function for backtrackFillVoices(). notes holds the available notes of every voice
+// from top to bottom, with the cantus on top. Returns every voice's melody, cantus first, or
+// nothing if there is no solution or the budget ran out first.
+
+bool backtrackFillVoices(vector<vector<int> >& voices, vector<map<int, int> >& notes,
+    MusicKey musicKey, vector<vector<vector<int> > >& staticDomains, vector<vector<int> > domains,
+    unsigned voice, long& budget);
+// Fills voice at the current time step from its domain, pruning the domains of the voices below
+// it after every choice. Returns false on failure or when the budget runs out.
+
+vector<vector<vector<int> > > getStaticVoiceDomains(vector<vector<int> >& voices,
+    vector<map<int, int> >& notes, MusicKey musicKey);
+// Returns the notes each ctrpt voice may take at every time step given only the cantus, pruned
+// until every note can be reached from the one before it and can reach the one after.
+
+vector<vector<int> > getVoiceDomains(vector<vector<int> >& voices,
+    vector<map<int, int> >& notes, MusicKey musicKey,
+    vector<vector<vector<int> > >& staticDomains);
+// Returns the notes each ctrpt voice may take at the next time step given its own melody.
+
+bool isAllowedVoiceNote(vector<vector<int> >& voices, unsigned voice, int note, unsigned time);
+// Returns true if the note is allowed at time on its own (start and cadence degrees).
+
+bool isAllowedVoiceStep(vector<vector<int> >& voices, MusicKey musicKey, unsigned voice,
+    int prevNote, int note, unsigned time);
+// Returns true if the voice may move from prevNote to note at time.
+
+bool isConsonantVoicePair(vector<vector<int> >& voices, MusicKey musicKey, unsigned upper,
+    int upperNote, unsigned lower, int lowerNote, unsigned time);
+// Returns true if the two notes may sound together at time, regardless of what came before.
+
+bool isAllowedVoicePair(vector<vector<int> >& voices, MusicKey musicKey, unsigned upper,
+    int upperNote, unsigned lower, int lowerNote, unsigned time);
+// Returns true if the two notes satisfy every pairwise constraint between two voices at time.
+
+MusicKey getMusicKey();
+// Returns the key given by user input.
+
+MusicKey lookupMusicKey(string inputKey);
+// Returns the key named by inputKey (A, Bb, C#m, D dorian, etc...). The tonic is -1 if the key
+// can't be read.
+
+int pitchClass(string name);
+// Returns the pitch class (C = 0 ... B = 11) of a note name without octave, or -1 on error.
+
+map<int, int> getNotes(MusicKey musicKey, const int range[]);
+// Returns a map from two digit int (note position in specified key & note octave) to MIDI note
+// for every note of the key in range.
+
+int notePos(int semitone, MusicKey musicKey);
+// Converts a semitone count from C0 to a 2-digit int specifying octave (10's place) and
+// position in musical key (1 - 7 in 1's place). The octave digit increments with the tonic.
+// Returns -1 if the note isn't in the key.
+
+vector<float> getMelodyFrequencies(vector<int> melody, map<int, int> notes,
+    MusicKey musicKey, bool cadence);
+// Returns the frequency of every note in melody. If the melody ends with a cadence, a VII
+// before the final note is raised to the mode's leading tone.
+
+vector<float> getFrequencies(vector<int> pitches, MusicKey musicKey);
+// Returns the frequency of every MIDI note in pitches in the current tuning.
+
+double getTuningRatio(int semitones, int degree);
+// Returns the ratio of the note semitones (0 - 11) above the tonic to the tonic in the current
+// tuning. degree (1 - 7, or 0 if it isn't one) tells which interval the note is, e.g. a minor
+// sixth rather than an augmented fifth.
+
+int getTuning(string name);
+// Returns the index into TUNINGS of the named tuning, or -1 if there isn't one.
 
 int getInterval(int note1, int note2);
 // Returns the interval between two notes as an integer.
@@ -80,53 +392,187 @@ int reduceInterval(int interval);
 bool isConsonant(int interval);
 // Returns true if provided interval is consonant, false otherwise.
 
-int getOctaveIndicator(vector<string> musicKey);
-// Returns the note in the key (I, II, ...) that the octave increments at by comparing notes
-// to "C". Returns -1 upon error.
+int getPitch(int note, MusicKey musicKey);
+// Returns the MIDI note of a 2-digit note in musicKey, the reverse of notePos().
+
+bool isAllowedLeadingTone(int note1, bool cadence1, int note2, bool cadence2, MusicKey musicKey);
+// Returns false if raising a VII to the leading tone turns the interval between the two notes
+// augmented or diminished. cadence1 and cadence2 say which notes come right before the final one.
+
+bool isDiatonicInterval(int interval, int semitones);
+// Returns true if an interval (unison = 1) spanning semitones is major, minor or perfect.
 
 //-------------------------------------------------------------------------------------------------
 // CONSTRAINT SATTISFACTION -----------------------------------------------------------------------
 //-------------------------------------------------------------------------------------------------
 
-map<int, float> getAllowedCantusNotes(map<int, float> notes, int prevNotes[],
+map<int, int> getAllowedCantusNotes(map<int, int> notes, MusicKey musicKey, int prevNotes[],
     int noteNum, int numNotes);
 // Checks all available notes against cantus constraints and returns all valid cantus notes as a
-// map from int (note position / octave) to float (note frequency).
+// map from int (note position / octave) to int (MIDI note).
 
-map<int, float> getAllowedCtrptNotes(vector<int> ctrptNotes, vector<int> cantusNotes,
-    map<int, float> notes);
+map<int, int> getAllowedCtrptNotes(vector<int> ctrptNotes, vector<int> cantusNotes,
+    map<int, int> notes, MusicKey musicKey);
 // Checks all available notes against ctrpt constraints and returns all valid ctrpt notes as a map
-// from int(note position / octave) to float (note frequency).
+// from int(note position / octave) to int (MIDI note).
+
+map<int, int> getAllowedMidCtrptNotes(vector<int> ctrptNotes, vector<int> cantusNotes,
+    map<int, int> notes);
+// Checks all available notes against the ctrpt constraints that apply between the opening and
+// the cadence. Returns valid ctrpt notes as a map from int to int (MIDI note).
+
+map<int, int> getAllowedSpeciesNotes(vector<int> grid, vector<int> cantusNotes,
+    map<int, int> notes, MusicKey musicKey, int species);
+// Checks all available notes against the second, third or fourth species constraints for the
+// next cell of the grid and returns all valid ones as a map from int to int (MIDI note).
 
-void removeParallelFifths(map<int, float>& allowedCtrptNotes, vector<int> ctrptNotes,
+bool isAllowedSpeciesNote(vector<int>& cantusNotes, int note, unsigned cell, int species);
+// Returns true if the note is allowed in cell on its own.
+
+bool isAllowedSpeciesStep(vector<int>& cantusNotes, int prevNote, int note, unsigned cell,
+    int species, MusicKey musicKey);
+// Returns true if the ctrpt may move from prevNote in the cell before to note in cell.
+
+void removeParallelFifths(map<int, int>& allowedCtrptNotes, vector<int> ctrptNotes,
     vector<int> cantusNotes);
 // Imposes constraint on ctrptNotes.
 
-void removeParallelEighths(map<int, float>& allowedCtrptNotes, vector<int> ctrptNotes,
+void removeParallelEighths(map<int, int>& allowedCtrptNotes, vector<int> ctrptNotes,
     vector<int> cantusNotes);
 // Imposes constraint on ctrptNotes.
 
-void remove3xLeap(map<int, float>& allowedCtrptNotes, vector<int> ctrptNotes);
+void remove3xLeap(map<int, int>& allowedCtrptNotes, vector<int> ctrptNotes);
 // Imposes constraint on ctrptNotes.
 
-void removeOppositeLeaps(map<int, float>& allowedCtrptNotes, vector<int> ctrptNotes);
+void removeOppositeLeaps(map<int, int>& allowedCtrptNotes, vector<int> ctrptNotes);
 // Imposes constraint on ctrptNotes.
 
-void remove4xIntervalOrNote(map<int, float>& allowedCtrptNotes, vector<int> ctrptNotes,
+void remove4xIntervalOrNote(map<int, int>& allowedCtrptNotes, vector<int> ctrptNotes,
     vector<int> cantusNotes);
 // Imposes constraint on ctrptNotes.
 
+//-------------------------------------------------------------------------------------------------
+// STREAMING --------------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------------------------
+
+void writeStreamFile(string filename);
+// Writes a .csd that plays score events read from stdin in real time.
+
+void streamMelody(MusicKey musicKey, int tempo, int maxMeasures, int lookahead);
+// Generates cantus and ctrpt together measure by measure and writes each measure to stdout as
+// real-time score events once it is proven continuable. Stops after a cadence, which is written
+// when requested or after maxMeasures (0 for no limit).
+
+bool fillStreamWindow(vector<int>& cantusWindow, vector<int>& ctrptWindow,
+    map<int, int> cantusNotes, map<int, int> ctrptNotes, MusicKey musicKey, int windowEnd,
+    bool cadence);
+// Extends both windows (which start out holding the committed context) to windowEnd notes.
+// Returns false if no continuation was found within the node budget.
+
+bool extendCantusWindow(vector<int>& cantusWindow, map<int, int> notes, MusicKey musicKey,
+    int windowEnd, bool cadence);
+// Randomly extends the cantus window to windowEnd notes. Returns false on a dead end.
+
+void writeStreamMeasure(vector<int> cantusMeasure, vector<int> ctrptMeasure,
+    map<int, int> cantusNotes, map<int, int> ctrptNotes, MusicKey musicKey, bool cadence,
+    double beatSeconds);
+// Writes one measure of both voices to stdout as real-time score events.
+
+void listenForCadence();
+// Requests a cadence once a line is read from stdin.
+
+//-------------------------------------------------------------------------------------------------
+// BATCH ------------------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------------------------
+
+void writeBatch(int count, MusicKey musicKey, int numMeasures, int tempo, int numThreads,
+    double stopEstimate);
+// Writes count different pieces to counterpoint_0.csd, counterpoint_1.csd, ... using numThreads
+// threads. Pieces already written are thrown away without touching the disk. Stops early once the
+// estimated chance of the next piece being new falls below stopEstimate (0 to never stop early).
+
+void writeBatchPiece(string filename, MusicKey musicKey, int tempo, vector<int> cantusNotes,
+    vector<int> ctrptNotes, map<int, int> cantusRange, map<int, int> ctrptRange);
+// Writes one finished piece to its own file.
+
+unsigned long long fingerprintPiece(vector<int>& cantusNotes, vector<int>& ctrptNotes);
+// Returns a hash of both melodies' degrees, so pieces that only differ in key share a fingerprint.
+
+int addFingerprint(vector<FingerprintShard>& shards, unsigned long long fingerprint);
+// Adds the fingerprint to the set and returns how many times it has been added, this time
+// included.
+
+//-------------------------------------------------------------------------------------------------
+// VERIFICATION -----------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------------------------
+
+bool verifySolvers(int iterations, unsigned seed);
+// Solves a random cantus in a random key, mode and length per iteration with the serial and
+// parallel ctrpt solvers and checks every melody against the rules from scratch. Short pieces
+// also have their solutions counted both ways. Case i is seeded with seed + i, which is printed
+// for every failure so --verify 1 <seed> replays it. Returns false if anything failed.
+
+string checkCantusMelody(vector<int>& cantusNotes, map<int, int>& notes, MusicKey musicKey);
+// Returns the first cantus rule the melody breaks, or "" if it follows them all.
+
+string checkCtrptMelody(vector<int>& ctrptNotes, vector<int>& cantusNotes,
+    map<int, int>& notes, MusicKey musicKey, unsigned cantusLag);
+// Returns the first ctrpt rule the melody breaks, or "" if it follows them all. See
+// checkCtrptNote() for cantusLag.
+
+string checkCtrptNote(vector<int>& ctrptNotes, vector<int>& cantusNotes,
+    map<int, int>& notes, MusicKey musicKey, unsigned index, unsigned cantusLag);
+// Returns the first ctrpt rule broken by the note at index given the notes before it, or "".
+// A note between the first and the cadence is measured against the cantus note cantusLag notes
+// before its own: 0 for the rules, 1 for the way getAllowedMidCtrptNotes() reads them.
+
+bool isAlteredLeadingToneLeap(int prev, int note, map<int, int>& notes, MusicKey musicKey);
+// Returns true if raising note, a VII before the final note, to the leading tone makes the leap
+// into it from prev augmented or diminished. Works from the MIDI notes in notes.
+
+long countCtrptMelodies(vector<int>& ctrptNotes, map<int, int>& notes, MusicKey musicKey,
+    vector<int>& cantusNotes, long limit);
+// Counts the ctrpt melodies backtrackFillCtrptMelody() can find, stopping at limit.
+
+long countCheckedMelodies(vector<int>& ctrptNotes, map<int, int>& notes, MusicKey musicKey,
+    vector<int>& cantusNotes, unsigned cantusLag, long limit);
+// Counts the ctrpt melodies checkCtrptNote() allows by trying every note at every position,
+// stopping at limit.
+
+//-------------------------------------------------------------------------------------------------
+// TRACING ----------------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------------------------
+
+long long traceNow();
+// Returns microseconds since the program started.
+
+TraceBuffer* getTraceBuffer();
+// Returns this thread's trace buffer, registering a new one the first time.
+
+vector<vector<TraceEvent> > getTraceEvents();
+// Returns the spans still held by every thread's buffer, one list per thread in order of start.
+
+void writeChromeTrace(string filename);
+// Writes every span as Chrome trace-event JSON (chrome://tracing, Perfetto).
+
+void writeFoldedTrace(string filename);
+// Writes the time spent in every stack of spans as folded stacks for flamegraph.pl, in
+// microseconds.
+
 //-------------------------------------------------------------------------------------------------
 // UTILS ------------------------------------------------------------------------------------------
 //-------------------------------------------------------------------------------------------------
 
-vector<int> getKeyList(map<int, float> notes);
+vector<int> getKeyList(map<int, int> notes);
 // Returns a list of keys from a given map.
 
 void seedRand();
 
 int randomNoteKey(vector<int> noteKeys);
 
+int randomNoteKey(vector<int> noteKeys, mt19937& rng);
+// Same as above, using the given generator so threads don't share rand()'s state.
+
 int getTempo();
 // Get the tempo in BPM.
 
@@ -136,6 +582,13 @@ int getNumMeasures();
 int calcTotalNotes(int numMeasures);
 // Calculate the total amount of time in seconds of the melody.
 
+vector<array<int, 2> > getVoiceRanges(int numVoices);
+// Returns the default ranges, top to bottom, for numVoices voices.
+
+void benchmarkSolvers(int runs);
+// Times the two voice and n-voice solvers over runs random pieces per voice count and prints a
+// table of the results.
+
 
 
 // END API-----------------------------------------------------------------------------------------
@@ -147,97 +600,188 @@ int calcTotalNotes(int numMeasures);
 **************************************************************************************************/
 
 // Opens and writes the first part of the score. Returns ofstream for further writing.
-ofstream startFile(string filename){
+ofstream startFile(string filename, string options, int numVoices){
+    TraceSpan span("startFile");
     ofstream myfile(filename);
     if (myfile.is_open()) {
         myfile << "<CsoundSynthesizer>\n";
         myfile << "<CsOptions>\n";
-        myfile << "-odac\n";
+        myfile << options << "\n";
         myfile << "</CsOptions>\n";
         myfile << "<CsInstruments>\n";
-        myfile << "instr 1\n";
-        myfile << "aSin vco2 0dbfs/4, p4\n";
-        myfile << "out aSin\n";
-        myfile << "endin\n\n";
-        myfile << "instr 2\n";
-        myfile << "aSin vco2 0dbfs/4, p4\n";
-        myfile << "out aSin\n";
-        myfile << "endin\n\n";
+        // One instrument per voice.
+        for (int i = 1; i <= numVoices; i++) {
+            myfile << "instr " << i << "\n";
+            myfile << "aSin vco2 0dbfs/4, p4\n";
+            myfile << "out aSin\n";
+            myfile << "endin\n\n";
+        }
         myfile << "</CsInstruments>\n";
         myfile << "<CsScore>\n";
         return myfile;
     }
     else {
-        cout << "Unable to open file.";
+        cerr << "Unable to open " << filename << ".\n";
         return ofstream("/dev/null");
     }
 }
 
 // Writes the cantus and ctrpt melodies to the file.
 void writeMelody(ofstream& myfile) {
+    TraceSpan span("writeMelody");
     if (myfile.is_open()) {
-        vector<string> musicKey;
+        MusicKey musicKey;
         do {
             musicKey = getMusicKey();
-        } while (musicKey.size() == 0);
-        int octIndicator = getOctaveIndicator(musicKey);
+        } while (musicKey.tonic == -1);
 
-        vector<int> cantusNotes = writeCantusMelody(myfile, musicKey, octIndicator);
-        writeCtrptMelody(myfile, musicKey, cantusNotes, octIndicator);
+        if (voiceRanges.size() > 0) {
+            writeVoicesMelody(myfile, musicKey, voiceRanges);
+        }
+        else if (ctrptSpecies > 1) {
+            writeSpeciesMelody(myfile, musicKey, ctrptSpecies);
+        }
+        else {
+            vector<int> cantusNotes = writeCantusMelody(myfile, musicKey);
+            writeCtrptMelody(myfile, musicKey, cantusNotes);
+        }
         myfile << "</CsScore>\n";
         myfile << "</CsoundSynthesizer>";
     }
 }
 
 // Generates and writes cantus melody to file. Returns cantus notes for further use.
-vector<int> writeCantusMelody(ofstream& myfile, vector<string> musicKey, int octIndicator) {
+vector<int> writeCantusMelody(ofstream& myfile, MusicKey musicKey) {
+    TraceSpan span("writeCantusMelody");
     vector<int> cantusNotes;
     if (myfile.is_open()) {
-        map<int, float> notes = getNotes(musicKey, octIndicator, ALTO);
-        vector<int> noteKeys = getKeyList(notes);
-        
+        map<int, int> notes = getNotes(musicKey, ALTO);
+
         int tempo = getTempo();
         int numMeasures = getNumMeasures();
         int totalNotes = calcTotalNotes(numMeasures);
-        int noteKey;
-        float note;
-        int noteNum = 1;
-        int prevNotes[] = { -1, -1 };
+        // No cantus can be generated without any notes, so don't go looking for one.
+        if (numMeasures < 1) {
+            cout << "Unable to write fewer than 1 measure.\n";
+            return cantusNotes;
+        }
 
         myfile << "t 0 " << tempo << endl << endl;
 
-        while (noteNum <= totalNotes) {
-            map<int, float> allowedNotes = getAllowedCantusNotes(notes, 
-                prevNotes, noteNum, totalNotes);
-            vector<int> allowedKeys = getKeyList(allowedNotes);
-            noteKey = randomNoteKey(allowedKeys);
-            cantusNotes.push_back(noteKey);
-            note = allowedNotes[noteKey];
-            prevNotes[1] = prevNotes[0];
-            prevNotes[0] = noteKey;
-            myfile << "i1 " << noteNum - 1 << " 1 " << note << endl;
-            noteNum += 1;
+        // Random choices can paint the cantus into a corner, so keep trying until one finishes.
+        do {
+            cantusNotes = generateCantusMelody(notes, musicKey, totalNotes);
+        } while (cantusNotes.size() == 0);
+
+        vector<float> freqs = getMelodyFrequencies(cantusNotes, notes, musicKey, true);
+        for (unsigned i = 0; i < freqs.size(); i++) {
+            myfile << "i1 " << i << " 1 " << freqs[i] << endl;
         }
     }
     return cantusNotes;
 }
 
+// Generates and writes a cantus and a ctrpt melody for every other voice range to file.
+void writeVoicesMelody(ofstream& myfile, MusicKey musicKey, vector<array<int, 2> > ranges) {
+    TraceSpan span("writeVoicesMelody");
+    if (myfile.is_open()) {
+        vector<map<int, int> > notes;
+        for (auto range : ranges) {
+            notes.push_back(getNotes(musicKey, range.data()));
+        }
+
+        int tempo = getTempo();
+        int numMeasures = getNumMeasures();
+        int totalNotes = calcTotalNotes(numMeasures);
+
+        vector<vector<int> > voices;
+        vector<int> cantusNotes = generateSolvableCantus(notes[0], musicKey, totalNotes,
+            [&](vector<int>& cantus, long& budget) {
+                voices = fillVoices(cantus, notes, musicKey, budget);
+                return voices.size() > 0;
+            });
+        if (cantusNotes.size() == 0) {
+            cout << "Unable to write " << ranges.size() << " voices.\n";
+            return;
+        }
+
+        myfile << "t 0 " << tempo << endl << endl;
+
+        for (unsigned v = 0; v < voices.size(); v++) {
+            vector<float> freqs = getMelodyFrequencies(voices[v], notes[v], musicKey, true);
+            for (unsigned i = 0; i < freqs.size(); i++) {
+                myfile << "i" << v + 1 << " " << i << " 1 " << freqs[i] << endl;
+            }
+        }
+    }
+}
+
 // Generates and writes ctrpt melody to file.
-void writeCtrptMelody(ofstream& myfile, vector<string> musicKey,
-    vector<int> cantusNotes, int octIndicator) {
+void writeCtrptMelody(ofstream& myfile, MusicKey musicKey, vector<int> cantusNotes) {
+    TraceSpan span("writeCtrptMelody");
+    if (myfile.is_open()) {
+        map<int, int> notes = getNotes(musicKey, TENOR);
+        vector<int> ctrptMelody = fillCtrptMelody(musicKey, cantusNotes);
+        vector<float> freqs = getMelodyFrequencies(ctrptMelody, notes, musicKey, true);
+        for (unsigned i = 0; i < freqs.size(); i++) {
+            myfile << "i2 " << i << " 1 " << freqs[i] << endl;
+        }
+    }
+}
+
+// Generates and writes a cantus and a second, third or fourth species ctrpt melody to file.
+void writeSpeciesMelody(ofstream& myfile, MusicKey musicKey, int species) {
+    TraceSpan span("writeSpeciesMelody");
     if (myfile.is_open()) {
-        map<int, float> notes = getNotes(musicKey, octIndicator, TENOR);
-        vector<int> noteKeys = getKeyList(notes);
-        vector<int> ctrptMelody = fillCtrptMelody(musicKey, cantusNotes, octIndicator);
-        for (unsigned i = 0; i < ctrptMelody.size(); i++) {
-            float note = notes[ctrptMelody[i]];
-            myfile << "i2 " << i << " 1 " << note << endl;
+        map<int, int> cantusRange = getNotes(musicKey, ALTO);
+        map<int, int> notes = getNotes(musicKey, TENOR);
+
+        int tempo = getTempo();
+        int numMeasures = getNumMeasures();
+        int totalNotes = calcTotalNotes(numMeasures);
+
+        vector<int> grid;
+        vector<int> cantusNotes = generateSolvableCantus(cantusRange, musicKey, totalNotes,
+            [&](vector<int>& cantus, long& budget) {
+                grid = fillSpeciesMelody(notes, musicKey, cantus, species, budget);
+                return grid.back() != -1;
+            });
+        if (cantusNotes.size() == 0) {
+            cout << "Unable to write species " << species << " ctrpt.\n";
+            return;
+        }
+
+        myfile << "t 0 " << tempo << endl << endl;
+        vector<float> cantusFreqs = getMelodyFrequencies(cantusNotes, cantusRange, musicKey, true);
+        for (unsigned i = 0; i < cantusFreqs.size(); i++) {
+            myfile << "i1 " << i << " 1 " << cantusFreqs[i] << endl;
+        }
+
+        vector<float> freqs = getMelodyFrequencies(grid, notes, musicKey, true);
+        int subdivisions = SPECIES_SUBDIVISIONS[species];
+        for (unsigned cell = 0; cell < grid.size(); cell++) {
+            double duration = 1.0 / subdivisions;
+            // Fourth species weak beats are tied over into the next strong beat.
+            bool tied = species == 4 && cell % subdivisions == 1 && cell + 2 < grid.size();
+            if (tied) {
+                duration *= 2;
+            }
+            // The final note lasts as long as the cantus note.
+            if (cell == grid.size() - 1) {
+                duration = 1;
+            }
+            myfile << "i2 " << (double)cell / subdivisions << " " << duration << " "
+                << freqs[cell] << endl;
+            if (tied) {
+                cell += 1;
+            }
         }
     }
 }
 
 // Closes the score.
 void endFile(ofstream& myfile) {
+    TraceSpan span("endFile");
     myfile.close();
 }
 
@@ -245,22 +789,72 @@ void endFile(ofstream& myfile) {
 *                                        COMPOSITION                                              *
 **************************************************************************************************/
 
+// Randomly generates a cantus melody. Returns an empty melody on a dead end.
+vector<int> generateCantusMelody(map<int, int> notes, MusicKey musicKey, int totalNotes) {
+    mt19937 rng(rand());
+    return generateCantusMelody(notes, musicKey, totalNotes, rng);
+}
+
+// Same as above, using the given generator so threads don't share rand()'s state.
+vector<int> generateCantusMelody(map<int, int> notes, MusicKey musicKey, int totalNotes,
+    mt19937& rng) {
+    TraceSpan span("generateCantusMelody");
+    vector<int> cantusNotes;
+    int prevNotes[] = { -1, -1 };
+    for (int noteNum = 1; noteNum <= totalNotes; noteNum++) {
+        map<int, int> allowedNotes = getAllowedCantusNotes(notes, musicKey, prevNotes, noteNum,
+            totalNotes);
+        if (allowedNotes.size() == 0) {
+            cantusNotes.clear();
+            return cantusNotes;
+        }
+        int noteKey = randomNoteKey(getKeyList(allowedNotes), rng);
+        cantusNotes.push_back(noteKey);
+        prevNotes[1] = prevNotes[0];
+        prevNotes[0] = noteKey;
+    }
+    return cantusNotes;
+}
+
+// Generates cantus melodies until solve() writes the other voices against one within its node
+// budget, giving up after SEARCH_CANTUS_ATTEMPTS. Returns the cantus, or nothing on failure.
+vector<int> generateSolvableCantus(map<int, int> notes, MusicKey musicKey, int totalNotes,
+    function<bool(vector<int>&, long&)> solve) {
+    // Some cantus lines leave the other voices no way out, so swap those for a new one.
+    for (int attempt = 0; attempt < SEARCH_CANTUS_ATTEMPTS; attempt++) {
+        vector<int> cantusNotes = generateCantusMelody(notes, musicKey, totalNotes);
+        long budget = SEARCH_NODE_BUDGET;
+        if (cantusNotes.size() > 0 && solve(cantusNotes, budget)) {
+            return cantusNotes;
+        }
+    }
+    return vector<int>();
+}
+
 // Container function for backtrackFillCtrptMelody(). Returns finished ctrpt melody.
-vector<int> fillCtrptMelody(vector<string> musicKey, vector<int> cantusNotes, int octIndicator) {
+vector<int> fillCtrptMelody(MusicKey musicKey, vector<int> cantusNotes) {
+    TraceSpan span("fillCtrptMelody");
     vector<int> ctrptNotes;
-    map<int, float> notes = getNotes(musicKey, octIndicator, TENOR);
-    return backtrackFillCtrptMelody(ctrptNotes, notes, cantusNotes);
+    map<int, int> notes = getNotes(musicKey, TENOR);
+    if (solverThreads > 1) {
+        return parallelFillCtrptMelody(notes, musicKey, cantusNotes, solverThreads);
+    }
+    return backtrackFillCtrptMelody(ctrptNotes, notes, musicKey, cantusNotes);
 }
 
 // Generates / returns ctrpt melody.
-vector<int> backtrackFillCtrptMelody(vector<int>& ctrptNotes, map<int, float> notes,
-    vector<int> cantusNotes) {
+vector<int> backtrackFillCtrptMelody(vector<int>& ctrptNotes, map<int, int> notes,
+    MusicKey musicKey, vector<int> cantusNotes) {
+    TraceSpan span("ctrpt depth", ctrptNotes.size());
     // Base case - finished writing ctrpt melody
     if (ctrptNotes.size() == cantusNotes.size()) {
         return ctrptNotes;
     }
 
-    map<int, float> allowedNotes = getAllowedCtrptNotes(ctrptNotes, cantusNotes, notes);
+    map<int, int> allowedNotes;
+    if (ctrptNotes.size() > 0 || isCtrptPossible(notes, musicKey, cantusNotes)) {
+        allowedNotes = getAllowedCtrptNotes(ctrptNotes, cantusNotes, notes, musicKey);
+    }
     // Failure
     if (allowedNotes.size() == 0) {
         ctrptNotes.push_back(-1);
@@ -268,7 +862,7 @@ vector<int> backtrackFillCtrptMelody(vector<int>& ctrptNotes, map<int, float> no
     }
 
     // Keep track of visited allowed notes
-    map<int, float> visited;
+    map<int, int> visited;
 
     vector<int> allowedNotesKeys;
     for (auto it : allowedNotes) {
@@ -283,7 +877,7 @@ vector<int> backtrackFillCtrptMelody(vector<int>& ctrptNotes, map<int, float> no
         } while (visited.count(noteKey) != 0);
         visited[noteKey] = allowedNotes[noteKey];
         ctrptNotes.push_back(noteKey);
-        vector<int> buffer = backtrackFillCtrptMelody(ctrptNotes, notes, cantusNotes);
+        vector<int> buffer = backtrackFillCtrptMelody(ctrptNotes, notes, musicKey, cantusNotes);
         // If the assignment was successful, return the complete melody.
         if (buffer.back() != -1) {
             return buffer;
@@ -298,231 +892,863 @@ vector<int> backtrackFillCtrptMelody(vector<int>& ctrptNotes, map<int, float> no
     return ctrptNotes;
 }
 
-// Reads in list of keys and returns a list of note names corresponding to the key given by user
-// input.
-vector<string> getMusicKey() {
-    string inputKey;
-    cout << "Please input desired key (A, B, C#, etc...): ";
-    cin >> inputKey;
+// Splits the ctrpt search into tasks solved by numThreads threads. Threads left without a task
+// race the others on tasks still being searched. The first thread to finish a melody wins and the
+// rest give up. Returns finished ctrpt melody.
+vector<int> parallelFillCtrptMelody(map<int, int> notes, MusicKey musicKey,
+    vector<int> cantusNotes, int numThreads) {
+    vector<int> solution;
+    if (!isCtrptPossible(notes, musicKey, cantusNotes)) {
+        solution.push_back(-1);
+        return solution;
+    }
 
-    ifstream keyTable("Keys.txt");
-    if (keyTable.is_open()) {
-        // initialize a match flag, a line holder, and the list to hold notes in the key.
-        bool match = false;
-        string line;
-        vector<string> myKey;
+    // Each task is a prefix of the melody from the top levels of the search tree. They're handed
+    // out in random order so different runs still explore different melodies first.
+    vector<vector<int> > tasks;
+    vector<int> prefix;
+    splitCtrptSearch(prefix, notes, musicKey, cantusNotes, PARALLEL_SPLIT_DEPTH, tasks);
+    mt19937 seeder(rand());
+    shuffle(tasks.begin(), tasks.end(), seeder);
+
+    atomic<unsigned> nextTask(0);
+    atomic<bool> solved(false);
+    // Tasks searched all the way through without a melody, which nobody needs to race on.
+    unique_ptr<atomic<bool>[]> exhausted(new atomic<bool>[tasks.size()]);
+    for (unsigned task = 0; task < tasks.size(); task++) {
+        exhausted[task] = false;
+    }
+    vector<thread> workers;
+    for (int i = 0; i < numThreads; i++) {
+        // Seed every worker differently so idle workers race down different paths.
+        unsigned seed = seeder();
+        workers.push_back(thread([&, seed]() {
+            mt19937 rng(seed);
+            while (!solved) {
+                unsigned task = nextTask++;
+                // Once every task is handed out, search one that's still open again in a fresh
+                // random order, so one hard task isn't left to a single thread.
+                if (task >= tasks.size()) {
+                    vector<unsigned> open;
+                    for (unsigned t = 0; t < tasks.size(); t++) {
+                        if (!exhausted[t]) {
+                            open.push_back(t);
+                        }
+                    }
+                    if (open.size() == 0) {
+                        break;
+                    }
+                    task = open[rng() % open.size()];
+                    rng.seed(rng());
+                }
+
+                TraceSpan span("parallel task");
+                vector<int> ctrptNotes = tasks[task];
+                if (backtrackFillCtrptTask(ctrptNotes, notes, musicKey, cantusNotes, rng, solved)) {
+                    // Only the first finisher gets to write the solution.
+                    if (!solved.exchange(true)) {
+                        solution = ctrptNotes;
+                    }
+                }
+                else if (!solved) {
+                    exhausted[task] = true;
+                }
+            }
+        }));
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    // No task successful - failure.
+    if (!solved) {
+        solution.push_back(-1);
+    }
+    return solution;
+}
 
-        // Initialize the holders for the stringstream.
-        string I, II, III, IV, V, VI, VII;
+// Container function for backtrackFillSpeciesMelody(). Returns the ctrpt melody as a grid of
+// SPECIES_SUBDIVISIONS[species] notes per cantus note, followed by a single final note. Ends in -1
+// on failure.
+vector<int> fillSpeciesMelody(map<int, int> notes, MusicKey musicKey, vector<int> cantusNotes,
+    int species, long& budget) {
+    TraceSpan span("fillSpeciesMelody");
+    vector<int> grid;
+    vector<map<int, int> > domains = getSpeciesDomains(notes, musicKey, cantusNotes, species);
+    // An empty domain means no melody fits this cantus, which is cheaper to find out here than by
+    // searching.
+    bool solvable = true;
+    for (auto domain : domains) {
+        solvable = solvable && domain.size() > 0;
+    }
+    if (!solvable ||
+            !backtrackFillSpeciesMelody(grid, domains, musicKey, cantusNotes, species, budget)) {
+        grid.push_back(-1);
+    }
+    return grid;
+}
 
-        // Eat the header
-        getline(keyTable, line);
+// Fills the rest of the grid in place from the notes left in each cell's domain. Returns false
+// on failure or when the budget runs out.
+bool backtrackFillSpeciesMelody(vector<int>& grid, vector<map<int, int> >& domains,
+    MusicKey musicKey, vector<int>& cantusNotes, int species, long& budget) {
+    TraceSpan span("species depth", grid.size());
+    // Base case - finished writing ctrpt melody
+    if (grid.size() == domains.size()) {
+        return true;
+    }
+    budget -= 1;
+    if (budget < 0) {
+        return false;
+    }
 
-        // Try and fill the list.
-        while (getline(keyTable, line) && !match) {
-            stringstream ss;
-            ss << line;
-            ss >> I;
-            if (I == inputKey) {
-                ss >> II >> III >> IV >> V >> VI >> VII;
-                myKey.push_back(I);
-                myKey.push_back(II);
-                myKey.push_back(III);
-                myKey.push_back(IV);
-                myKey.push_back(V);
-                myKey.push_back(VI);
-                myKey.push_back(VII);
-                match = true;
-            }
+    // Try the allowed notes in random order.
+    vector<int> allowedKeys = getKeyList(getAllowedSpeciesNotes(grid, cantusNotes,
+        domains[grid.size()], musicKey, species));
+    while (allowedKeys.size() > 0) {
+        int randIndex = rand() % allowedKeys.size();
+        grid.push_back(allowedKeys[randIndex]);
+        allowedKeys.erase(allowedKeys.begin() + randIndex);
+        if (backtrackFillSpeciesMelody(grid, domains, musicKey, cantusNotes, species, budget)) {
+            return true;
         }
-        return myKey;
-    }
-    else {
-        cout << "Unable to read keys file.\n";
-        vector<string> noKey;
-        return noKey;
+        grid.pop_back();
     }
+    return false;
 }
 
-// Reads in NoteFrequencies.txt and populates a map from two digit int (note position in specified
-// key & note octave) to float (corresponding frequencies).
-map<int, float> getNotes(vector<string> musicKey, int octIndicator, const double range[]) {
+// Returns the notes every cell of the grid may take given only the cantus, pruned until every
+// note can be reached from the cell before it and can reach the cell after.
+vector<map<int, int> > getSpeciesDomains(map<int, int> notes, MusicKey musicKey,
+    vector<int> cantusNotes, int species) {
+    unsigned numCells = (cantusNotes.size() - 1) * SPECIES_SUBDIVISIONS[species] + 1;
+    vector<map<int, int> > domains(numCells);
+    for (unsigned cell = 0; cell < numCells; cell++) {
+        for (auto it : notes) {
+            if (isAllowedSpeciesNote(cantusNotes, it.first, cell, species)) {
+                domains[cell][it.first] = it.second;
+            }
+        }
+    }
+
+    pruneDomains(domains, [&](int prevNote, int note, unsigned cell) {
+        return isAllowedSpeciesStep(cantusNotes, prevNote, note, cell, species, musicKey);
+    });
+    return domains;
+}
 
-    ifstream noteTable("NoteFrequencies.txt");
-    map<int, float> notes;
-    if (noteTable.is_open()) {
-        // line holds lines... note will help make a key in a map to corresp. freq.
-        string line;
-        string note;
-        float freq;
-
-        // Eat the header...
-        getline(noteTable, line);
-
-        while (getline(noteTable, line)) {
-            // ss should take the line and return the items in the first two columns.
-            stringstream ss;
-            ss << line;
-            ss >> note >> freq;
-
-            // We only want to add the note if it's in the specified range.
-            if (freq >= range[0] && freq <= range[1]) {
-                // We also will only add the note if it's in our desired key.
-                bool match = false;
-                for (auto it : musicKey) {
-                    // string.find(substr) returns string: :npos if substr isn't in string.
-                    if (note.find(it) != string::npos) {
-                        // Making sure both notes are sharp or both are natural.
-                        if (note.find("#") == it.find("#")) {
-                            match = true;
-                        }
+// Removes notes from a melody's domains until every note can be reached from one in the domain
+// before it and can reach one in the domain after. isAllowedStep() says whether the melody may
+// move from prevNote to note at index.
+void pruneDomains(vector<map<int, int> >& domains,
+    function<bool(int prevNote, int note, unsigned index)> isAllowedStep) {
+    // Sweep backwards then forwards until nothing else is removed.
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int index = (int)domains.size() - 2; index >= 0; index--) {
+            vector<int> removalList;
+            for (auto it : domains[index]) {
+                bool reachable = false;
+                for (auto next : domains[index + 1]) {
+                    if (isAllowedStep(it.first, next.first, index + 1)) {
+                        reachable = true;
+                        break;
                     }
                 }
-                if (match) {
-                    int key = notePos(note, musicKey, octIndicator);
-                    if (key != -1) {
-                        notes[key] = freq;
+                if (!reachable) {
+                    removalList.push_back(it.first);
+                }
+            }
+            for (auto it : removalList) {
+                domains[index].erase(it);
+            }
+            changed = changed || removalList.size() > 0;
+        }
+        for (unsigned index = 1; index < domains.size(); index++) {
+            vector<int> removalList;
+            for (auto it : domains[index]) {
+                bool reachable = false;
+                for (auto prev : domains[index - 1]) {
+                    if (isAllowedStep(prev.first, it.first, index)) {
+                        reachable = true;
+                        break;
                     }
                 }
+                if (!reachable) {
+                    removalList.push_back(it.first);
+                }
             }
+            for (auto it : removalList) {
+                domains[index].erase(it);
+            }
+            changed = changed || removalList.size() > 0;
         }
-        noteTable.close();
-        return notes;
     }
-    cout << "no dice" << endl;
-    map<int, float> empty;
-    return empty;
 }
 
-// Converts a string (C1, A#2, etc...) to a 2-digit int specifying octave (10's place) and
-// position in musical key (1 - 7 in 1's place). OctIndicator orients the process such that
-// the octave digit increments with the correct note.
-int notePos(string note, vector<string> musicKey, int octIndicator) {
-    int notepos = -1;
-    int octave = note.back() - '0';
-    note.pop_back();
-    for (unsigned i = 0; i < musicKey.size(); i++) {
-        if (note.compare(musicKey[i]) == 0) {
-            // Plus one to adhere to music convention... tonic is 1, not 0.
-            notepos = i + 1;
-            break;
+// Returns false if some ctrpt note is left with nothing to choose from once the notes the rest of
+// the melody can't join are pruned. Cheap next to an exhaustive search that finds nothing.
+bool isCtrptPossible(map<int, int>& notes, MusicKey musicKey, vector<int>& cantusNotes) {
+    // The same rules getAllowedCtrptNotes() applies note by note, minus the ones that look
+    // further back than the note before.
+    unsigned total = cantusNotes.size();
+    vector<map<int, int> > domains(total);
+    for (unsigned index = 0; index < total; index++) {
+        for (auto it : notes) {
+            bool allowed;
+            if (index == 0 || index == total - 1) {
+                allowed = it.first % 10 == 1;
+            }
+            else if (index == total - 2) {
+                allowed = it.first % 10 == (cantusNotes[total - 2] % 10 == 2 ? 7 : 2);
+            }
+            else {
+                int cantus = cantusNotes[index - 1];
+                int interval = getInterval(cantus, it.first);
+                allowed = isConsonant(interval) && interval <= 12 && it.first < cantus;
+            }
+            if (allowed) {
+                domains[index][it.first] = it.second;
+            }
         }
     }
-    if (notepos == -1) {
-        cout << "Error in notePos(): note not in musicKey.\n";
-        return notepos;
-    }
-    if (notepos >= octIndicator) {
-        return (10 * octave) + notepos;
-    }
-    else {
-        return (10 * (octave + 1)) + notepos;
+
+    pruneDomains(domains, [&](int prevNote, int note, unsigned index) {
+        if (index == total - 1) {
+            return getInterval(prevNote, note) == 2;
+        }
+        if (index == total - 2) {
+            return isAllowedLeadingTone(prevNote, false, note, true, musicKey);
+        }
+        return getInterval(prevNote, note) <= 6;
+    });
+    for (auto domain : domains) {
+        if (domain.size() == 0) {
+            return false;
+        }
     }
+    return true;
 }
 
-// Returns the interval between two notes as an integer. 
-int getInterval(int note1, int note2) {
-    // /10 & %10 because notes 1 & 2 are exclusively for two digit numbers.
-    // Note that the + 1 posInt is to adhere to music notation that the interval
-    // from a note to itself (C0 to C0 for example) is one.The sevens account
-    // for multi - octave intervals.
-    int first = 7 * (note1 / 10) + (note1 % 10);
-    int second = 7 * (note2 / 10) + (note2 % 10);
-    return abs(first - second) + 1;
+// Collects every allowed ctrpt melody prefix that is depth notes longer than ctrptNotes.
+void splitCtrptSearch(vector<int>& ctrptNotes, map<int, int>& notes, MusicKey musicKey,
+    vector<int>& cantusNotes, int depth, vector<vector<int> >& tasks) {
+    if (depth == 0 || ctrptNotes.size() == cantusNotes.size()) {
+        tasks.push_back(ctrptNotes);
+        return;
+    }
+    map<int, int> allowedNotes = getAllowedCtrptNotes(ctrptNotes, cantusNotes, notes, musicKey);
+    for (auto it : allowedNotes) {
+        ctrptNotes.push_back(it.first);
+        splitCtrptSearch(ctrptNotes, notes, musicKey, cantusNotes, depth - 1, tasks);
+        ctrptNotes.pop_back();
+    }
 }
 
-// Reduces an interval to its smallest form... (e.g. 10 -> 3)
-int reduceInterval(int interval) {
-    if (interval <= 7) {
-        return interval;
+// Completes ctrptNotes in place. Returns false on failure or once another task has solved the
+// melody.
+bool backtrackFillCtrptTask(vector<int>& ctrptNotes, map<int, int>& notes, MusicKey musicKey,
+    vector<int>& cantusNotes, mt19937& rng, atomic<bool>& solved) {
+    // Without a budget a cantus with no ctrpt is searched all the way through, so rule that out
+    // first.
+    if (ctrptNotes.size() == 0 && !isCtrptPossible(notes, musicKey, cantusNotes)) {
+        return false;
     }
-    return reduceInterval(interval - 7);
+    long budget = LONG_MAX;
+    return backtrackFillCtrptTask(ctrptNotes, notes, musicKey, cantusNotes, rng, solved, true,
+        budget);
 }
 
-// Returns true if provided interval is consonant, false otherwise.
-bool isConsonant(int interval) {
-    int redInt = reduceInterval(interval);
-    if (redInt == 1 || redInt == 3 || redInt == 5 || redInt == 6) {
+// Same as above, also giving up when the budget runs out. Without a cadence the melody ends
+// mid-phrase, so only the first note gets the cadence rules' checks.
+bool backtrackFillCtrptTask(vector<int>& ctrptNotes, map<int, int>& notes, MusicKey musicKey,
+    vector<int>& cantusNotes, mt19937& rng, atomic<bool>& solved, bool cadence, long& budget) {
+    TraceSpan span("ctrpt depth", ctrptNotes.size());
+    // Base case - finished writing ctrpt melody
+    if (ctrptNotes.size() == cantusNotes.size()) {
         return true;
     }
-    return false;
-}
+    // Someone else finished first.
+    if (solved.load(memory_order_relaxed)) {
+        return false;
+    }
+    budget -= 1;
+    if (budget < 0) {
+        return false;
+    }
 
-// Returns the note in the key (I, II, ...) that the octave increments at by comparing notes
-// to "C". Returns -1 upon error.
-int getOctaveIndicator(vector<string> musicKey) {
-    string tonic = musicKey[0];
-    int proximityIndicator = tonic.compare("C");
-    if (proximityIndicator == 0) {
-        return 1;
+    // Try the allowed notes in random order.
+    map<int, int> allowedNotes;
+    if (cadence || ctrptNotes.size() == 0) {
+        allowedNotes = getAllowedCtrptNotes(ctrptNotes, cantusNotes, notes, musicKey);
     }
-    if (proximityIndicator < 0) {
-        for (unsigned i = 1; i < musicKey.size(); i++) {
-            if (musicKey[i].compare("C") >= 0) {
-                // + 1 to fit in with tonic = 1, not 0.
-                return i + 1;
-            }
+    else {
+        allowedNotes = getAllowedMidCtrptNotes(ctrptNotes, cantusNotes, notes);
+    }
+    vector<int> allowedKeys = getKeyList(allowedNotes);
+    shuffle(allowedKeys.begin(), allowedKeys.end(), rng);
+    for (auto noteKey : allowedKeys) {
+        ctrptNotes.push_back(noteKey);
+        if (backtrackFillCtrptTask(ctrptNotes, notes, musicKey, cantusNotes, rng, solved, cadence,
+                budget)) {
+            return true;
         }
-        return -1;
+        ctrptNotes.pop_back();
     }
-    else {
-        for (int i = musicKey.size() - 1; i > 0; i--) {
-            if (musicKey[i].compare("C") < 0) {
-                // + 2 for tonic = 1 and we've found the note one before
-                // the switch.
-                return i + 2;
-            }
-            else if (musicKey[i].compare("C") == 0) {
-                return i + 1;
+    return false;
+}
+
+// Container function for backtrackFillVoices(). notes holds the available notes of every voice
+// from top to bottom, with the cantus on top. Returns every voice's melody, cantus first, or
+// nothing if there is no solution or the budget ran out first.
+vector<vector<int> > fillVoices(vector<int> cantusNotes, vector<map<int, int> > notes,
+    MusicKey musicKey, long& budget) {
+    TraceSpan span("fillVoices");
+    vector<vector<int> > voices(notes.size());
+    voices[0] = cantusNotes;
+
+    // Most cantus lines that can't be harmonized are caught here without searching at all.
+    vector<vector<vector<int> > > staticDomains = getStaticVoiceDomains(voices, notes, musicKey);
+    for (unsigned v = 1; v < voices.size(); v++) {
+        for (auto domain : staticDomains[v]) {
+            if (domain.size() == 0) {
+                voices.clear();
+                return voices;
             }
         }
-        return -1;
     }
-}
 
-/**************************************************************************************************
-*                                  CONSTRAINT SATISFACTION                                        *
-**************************************************************************************************/
+    // Starting past the last voice makes the search compute the first time step's domains.
+    vector<vector<int> > domains;
+    if (!backtrackFillVoices(voices, notes, musicKey, staticDomains, domains, voices.size(),
+            budget)) {
+        voices.clear();
+    }
+    return voices;
+}
 
-// Checks all available notes against cantus constraints and returns all valid cantus notes as a
-// map from int (note position / octave) to float (note frequency).
-map<int, float> getAllowedCantusNotes(map<int, float> notes, int prevNotes[],
-    int noteNum, int totalNotes) {
-    map<int, float> allowedNotes;
-    // Start with the tonic.
-    if (noteNum == 1) {
-        for (auto it : notes) {
-            if (it.first % 10 == 1) {
-                allowedNotes[it.first] = it.second;
+// Fills voice at the current time step from its domain, pruning the domains of the voices below
+// it after every choice. Returns false on failure or when the budget runs out.
+bool backtrackFillVoices(vector<vector<int> >& voices, vector<map<int, int> >& notes,
+    MusicKey musicKey, vector<vector<vector<int> > >& staticDomains, vector<vector<int> > domains,
+    unsigned voice, long& budget) {
+    // Every voice has a note at this time step - move on to the next one.
+    if (voice == voices.size()) {
+        // Base case - finished writing every voice.
+        if (voices.back().size() == voices[0].size()) {
+            return true;
+        }
+        domains = getVoiceDomains(voices, notes, musicKey, staticDomains);
+        for (unsigned v = 1; v < domains.size(); v++) {
+            if (domains[v].size() == 0) {
+                return false;
             }
         }
+        voice = 1;
     }
-    // End with the tonic, but it should be stepwise from the last note... so we'll get
-    // to the last note needing to be II or VII. 
-    else if (noteNum == totalNotes) {
-        for (auto it : notes) {
-            int interval = getInterval(prevNotes[0], it.first);
-            if ((interval == 2) && (it.first % 10 == 1)) {
-                allowedNotes[it.first] = it.second;
+    budget -= 1;
+    if (budget < 0) {
+        return false;
+    }
+
+    // Try the notes left in the domain in random order.
+    unsigned time = voices[voice].size();
+    vector<int> candidates = domains[voice];
+    while (candidates.size() > 0) {
+        int randIndex = rand() % candidates.size();
+        int note = candidates[randIndex];
+        candidates.erase(candidates.begin() + randIndex);
+
+        // Prune the voices below against this note before going any deeper.
+        vector<vector<int> > pruned = domains;
+        bool consistent = true;
+        for (unsigned lower = voice + 1; lower < voices.size() && consistent; lower++) {
+            vector<int> kept;
+            for (auto lowerNote : pruned[lower]) {
+                if (isAllowedVoicePair(voices, musicKey, voice, note, lower, lowerNote, time)) {
+                    kept.push_back(lowerNote);
+                }
             }
+            pruned[lower] = kept;
+            consistent = kept.size() > 0;
+        }
+        if (!consistent) {
+            continue;
+        }
+
+        voices[voice].push_back(note);
+        if (backtrackFillVoices(voices, notes, musicKey, staticDomains, pruned, voice + 1,
+                budget)) {
+            return true;
         }
+        voices[voice].pop_back();
     }
-    // Second to last note must be II or VII, and i don't want leaps larger than a sixth.
-    else if (noteNum == totalNotes - 1) {
-        for (auto it : notes) {
-            int interval = getInterval(prevNotes[0], it.first);
-            if ((interval <= 6) && ((it.first % 10 == 2) || (it.first % 10 == 7))) {
-                allowedNotes[it.first] = it.second;
+    return false;
+}
+
+// Returns the notes each ctrpt voice may take at every time step given only the cantus, pruned
+// until every note can be reached from the one before it and can reach the one after.
+vector<vector<vector<int> > > getStaticVoiceDomains(vector<vector<int> >& voices,
+    vector<map<int, int> >& notes, MusicKey musicKey) {
+    unsigned totalNotes = voices[0].size();
+    vector<vector<vector<int> > > domains(voices.size(), vector<vector<int> >(totalNotes));
+    for (unsigned v = 1; v < voices.size(); v++) {
+        vector<map<int, int> > voiceDomains(totalNotes);
+        for (unsigned time = 0; time < totalNotes; time++) {
+            for (auto it : notes[v]) {
+                if (isAllowedVoiceNote(voices, v, it.first, time) &&
+                        isConsonantVoicePair(voices, musicKey, 0, voices[0][time], v, it.first,
+                            time)) {
+                    voiceDomains[time][it.first] = it.second;
+                }
             }
         }
+
+        pruneDomains(voiceDomains, [&](int prevNote, int note, unsigned time) {
+            return isAllowedVoiceStep(voices, musicKey, v, prevNote, note, time);
+        });
+        for (unsigned time = 0; time < totalNotes; time++) {
+            domains[v][time] = getKeyList(voiceDomains[time]);
+        }
     }
-    // Second note will have prev[1] = -1.
-    else if (prevNotes[1] == -1) {
-        for (auto it : notes) {
-            int interval = getInterval(prevNotes[0], it.first);
-            // Just don't leap too far.
-            if (interval <= 6) {
-                allowedNotes[it.first] = it.second;
+    return domains;
+}
+
+// Returns the notes each ctrpt voice may take at the next time step given its own melody.
+vector<vector<int> > getVoiceDomains(vector<vector<int> >& voices,
+    vector<map<int, int> >& notes, MusicKey musicKey,
+    vector<vector<vector<int> > >& staticDomains) {
+    vector<vector<int> > domains(voices.size());
+    unsigned totalNotes = voices[0].size();
+    unsigned time = voices[1].size();
+    for (unsigned v = 1; v < voices.size(); v++) {
+        vector<int>& melody = voices[v];
+        map<int, int> allowedNotes;
+        for (auto note : staticDomains[v][time]) {
+            if (time == 0 || isAllowedVoiceStep(voices, musicKey, v, melody.back(), note, time)) {
+                allowedNotes[note] = notes[v][note];
+            }
+        }
+
+        // Same leap rules as the two voice ctrpt, away from the cadence.
+        if (time >= 2 && time < totalNotes - 2) {
+            removeOppositeLeaps(allowedNotes, melody);
+        }
+        if (time >= 3 && time < totalNotes - 2) {
+            remove3xLeap(allowedNotes, melody);
+            // Same note three times.
+            if (melody.end()[-1] == melody.end()[-2] && melody.end()[-1] == melody.end()[-3]) {
+                allowedNotes.erase(melody.back());
+            }
+        }
+
+        for (auto it : allowedNotes) {
+            if (isAllowedVoicePair(voices, musicKey, 0, voices[0][time], v, it.first, time)) {
+                domains[v].push_back(it.first);
+            }
+        }
+    }
+    return domains;
+}
+
+// Returns true if the note is allowed at time on its own (start and cadence degrees). The voice
+// right under the cantus takes the two voice ctrpt's cadence, the lowest voice holds the tonic at
+// both ends, and any voices between them fill in the chords.
+bool isAllowedVoiceNote(vector<vector<int> >& voices, unsigned voice, int note, unsigned time) {
+    unsigned totalNotes = voices[0].size();
+    bool lowest = voice == voices.size() - 1;
+    bool clausula = voice == 1;
+    int degree = note % 10;
+    bool chordTone = degree == 1 || degree == 3 || degree == 5;
+
+    // Start with the tonic, or any note of the tonic chord between the outer voices.
+    if (time == 0) {
+        return degree == 1 || (!lowest && !clausula && chordTone);
+    }
+    // End on the tonic, or any note of the tonic chord between the outer voices.
+    if (time == totalNotes - 1) {
+        return degree == 1 || (!lowest && !clausula && chordTone);
+    }
+    // Penultimate note is VII against a II in the cantus and II otherwise. The lowest voice may
+    // also take the dominant.
+    if (time == totalNotes - 2) {
+        int leadingDegree = voices[0].end()[-2] % 10 == 2 ? 7 : 2;
+        if (clausula) {
+            return degree == leadingDegree;
+        }
+        return !lowest || degree == 2 || degree == 5 || degree == 7;
+    }
+    return true;
+}
+
+// Returns true if the voice may move from prevNote to note at time.
+bool isAllowedVoiceStep(vector<vector<int> >& voices, MusicKey musicKey, unsigned voice,
+    int prevNote, int note, unsigned time) {
+    int interval = getInterval(prevNote, note);
+    // Raising VII to the leading tone mustn't make the move into or out of it augmented or
+    // diminished.
+    unsigned totalNotes = voices[0].size();
+    if (!isAllowedLeadingTone(prevNote, time == totalNotes - 1, note, time == totalNotes - 2,
+            musicKey)) {
+        return false;
+    }
+    // The outer voices reach the final tonic by step, or from the dominant in the lowest voice.
+    if (time == totalNotes - 1) {
+        bool lowest = voice == voices.size() - 1;
+        if (voice == 1 || lowest) {
+            bool fromDominant = lowest && prevNote % 10 == 5 && (interval == 4 || interval == 5);
+            return interval == 2 || fromDominant;
+        }
+        return interval <= 3;
+    }
+    // Don't leap further than a sixth.
+    return interval <= 6;
+}
+
+// Returns true if the two notes may sound together at time, regardless of what came before.
+bool isConsonantVoicePair(vector<vector<int> >& voices, MusicKey musicKey, unsigned upper,
+    int upperNote, unsigned lower, int lowerNote, unsigned time) {
+    // No crossing, and unisons only on the first and last notes.
+    bool ends = time == 0 || time == voices[0].size() - 1;
+    if (lowerNote > upperNote || (lowerNote == upperNote && !ends)) {
+        return false;
+    }
+
+    // Consonant, and neighbouring voices stay within a twelfth. Fourths are only dissonant
+    // against the lowest voice.
+    int interval = getInterval(upperNote, lowerNote);
+    bool fourth = reduceInterval(interval) == 4 && lower != voices.size() - 1;
+    bool cadence = time == voices[0].size() - 2;
+    return (isConsonant(interval) || fourth) && (lower != upper + 1 || interval <= 12) &&
+        isAllowedLeadingTone(upperNote, cadence, lowerNote, cadence, musicKey);
+}
+
+// Returns true if the two notes satisfy every pairwise constraint between two voices at time.
+bool isAllowedVoicePair(vector<vector<int> >& voices, MusicKey musicKey, unsigned upper,
+    int upperNote, unsigned lower, int lowerNote, unsigned time) {
+    if (!isConsonantVoicePair(voices, musicKey, upper, upperNote, lower, lowerNote, time)) {
+        return false;
+    }
+
+    // No parallel fifths or octaves.
+    int interval = getInterval(upperNote, lowerNote);
+    if (time >= 1) {
+        int prevInterval = reduceInterval(getInterval(voices[upper][time - 1],
+            voices[lower][time - 1]));
+        if ((prevInterval == 5 || prevInterval == 1) && reduceInterval(interval) == prevInterval) {
+            return false;
+        }
+    }
+
+    // Same interval four times in a row.
+    if (time >= 3) {
+        bool repeated = true;
+        for (unsigned i = time - 3; i < time; i++) {
+            if (getInterval(voices[upper][i], voices[lower][i]) != interval) {
+                repeated = false;
+            }
+        }
+        if (repeated) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Returns the key given by user input.
+MusicKey getMusicKey() {
+    TraceSpan span("getMusicKey");
+    string inputKey;
+    string modeName;
+    cout << "Please input desired key (A, Bb, C#m, D dorian, etc...): ";
+    cin >> inputKey;
+    // The mode, if any, is the rest of the line.
+    getline(cin, modeName);
+    return lookupMusicKey(inputKey + modeName);
+}
+
+// Returns the key named by inputKey (A, Bb, C#m, D dorian, etc...). The tonic is -1 if the key
+// can't be read.
+MusicKey lookupMusicKey(string inputKey) {
+    MusicKey musicKey;
+    musicKey.tonic = -1;
+    musicKey.mode = 0;
+
+    // The tonic is a letter and an optional sharp or flat.
+    unsigned modeStart = 1;
+    if (inputKey.size() > 1 && (inputKey[1] == '#' || inputKey[1] == 'b')) {
+        modeStart = 2;
+    }
+    int tonic = pitchClass(inputKey.substr(0, modeStart));
+    if (tonic == -1) {
+        cerr << "Unknown key " << inputKey << ".\n";
+        return musicKey;
+    }
+
+    // Whatever follows names the mode, major if nothing does.
+    string modeName;
+    stringstream ss;
+    ss << inputKey.substr(modeStart);
+    ss >> modeName;
+    for (auto& c : modeName) {
+        c = tolower(c);
+    }
+    if (modeName == "" || modeName == "ionian") {
+        modeName = "major";
+    }
+    else if (modeName == "m" || modeName == "aeolian") {
+        modeName = "minor";
+    }
+    for (int i = 0; i < NUM_MODES; i++) {
+        if (MODES[i].name == modeName) {
+            musicKey.mode = i;
+            musicKey.tonic = tonic;
+        }
+    }
+    if (musicKey.tonic == -1) {
+        cerr << "Unknown mode " << modeName << ".\n";
+        return musicKey;
+    }
+
+    for (int i = 0; i < 12; i++) {
+        musicKey.degrees[i] = 0;
+    }
+    for (int i = 0; i < 7; i++) {
+        // Plus one to adhere to music convention... tonic is 1, not 0.
+        musicKey.degrees[(tonic + MODES[musicKey.mode].steps[i]) % 12] = i + 1;
+    }
+    return musicKey;
+}
+
+// Returns the pitch class (C = 0 ... B = 11) of a note name without octave, or -1 on error.
+int pitchClass(string name) {
+    if (name.size() == 0 || name[0] < 'A' || name[0] > 'G') {
+        return -1;
+    }
+    int pitch = LETTER_PITCHES[name[0] - 'A'];
+    for (unsigned i = 1; i < name.size(); i++) {
+        if (name[i] == '#') {
+            pitch += 1;
+        }
+        else if (name[i] == 'b') {
+            pitch -= 1;
+        }
+        else {
+            return -1;
+        }
+    }
+    return (pitch + 12) % 12;
+}
+
+// Returns a map from two digit int (note position in specified key & note octave) to MIDI note
+// for every note of the key in range.
+map<int, int> getNotes(MusicKey musicKey, const int range[]) {
+    TraceSpan span("getNotes");
+    map<int, int> notes;
+    for (int pitch = range[0]; pitch <= range[1]; pitch++) {
+        // MIDI starts at C-1, twelve semitones below C0.
+        int key = notePos(pitch - 12, musicKey);
+        // We only add the note if it's in our desired key.
+        if (key != -1) {
+            notes[key] = pitch;
+        }
+    }
+    return notes;
+}
+
+// Converts a semitone count from C0 to a 2-digit int specifying octave (10's place) and
+// position in musical key (1 - 7 in 1's place). The octave digit increments with the tonic.
+// Returns -1 if the note isn't in the key.
+int notePos(int semitone, MusicKey musicKey) {
+    int notepos = musicKey.degrees[semitone % 12];
+    if (notepos == 0) {
+        return -1;
+    }
+    // Plus twelve keeps notes below the tonic in octave 0 from going negative.
+    int octave = (semitone - musicKey.tonic + 12) / 12;
+    return (10 * octave) + notepos;
+}
+
+// Returns the frequency of every note in melody. If the melody ends with a cadence, a VII
+// before the final note is raised to the mode's leading tone.
+vector<float> getMelodyFrequencies(vector<int> melody, map<int, int> notes,
+    MusicKey musicKey, bool cadence) {
+    vector<int> pitches;
+    for (auto noteKey : melody) {
+        pitches.push_back(notes[noteKey]);
+    }
+    if (cadence && melody.size() >= 2 && melody.end()[-2] % 10 == 7) {
+        pitches.end()[-2] += MODES[musicKey.mode].leadingToneRaise;
+    }
+    return getFrequencies(pitches, musicKey);
+}
+
+// Returns the frequency of every MIDI note in pitches in the current tuning.
+vector<float> getFrequencies(vector<int> pitches, MusicKey musicKey) {
+    // Tune one octave of pitch classes and every octave once, so each note is then just two
+    // lookups and a multiply in a loop the compiler can vectorize.
+    float pitchClasses[12];
+    // The tonic in octave 4, counted in semitones from A4.
+    double tonic = tuningA4 * pow(2.0, (musicKey.tonic - 9) / 12.0);
+    const Mode& mode = MODES[musicKey.mode];
+    for (int i = 0; i < 12; i++) {
+        int pitch = (musicKey.tonic + i) % 12;
+        int degree = musicKey.degrees[pitch];
+        // The raised leading tone isn't in the key, but it's still VII.
+        if (degree == 0 && i == mode.steps[6] + mode.leadingToneRaise) {
+            degree = 7;
+        }
+        // Pitch classes below the tonic are tuned an octave down so the table is all octave 4.
+        pitchClasses[pitch] = (float)(tonic * getTuningRatio(i, degree) *
+            (pitch < musicKey.tonic ? 0.5 : 1));
+    }
+    // MIDI octave 5 holds octave 4 (C4 = 60).
+    float octaves[11];
+    for (int octave = 0; octave < 11; octave++) {
+        octaves[octave] = (float)ldexp(1.0, octave - 5);
+    }
+
+    vector<float> freqs(pitches.size());
+    for (unsigned i = 0; i < pitches.size(); i++) {
+        freqs[i] = pitchClasses[pitches[i] % 12] * octaves[pitches[i] / 12];
+    }
+    return freqs;
+}
+
+// Returns the ratio of the note semitones (0 - 11) above the tonic to the tonic in the current
+// tuning. degree (1 - 7, or 0 if it isn't one) tells which interval the note is, e.g. a minor
+// sixth rather than an augmented fifth.
+double getTuningRatio(int semitones, int degree) {
+    if (TUNINGS[tuning].fifth == 0) {
+        return JUST_RATIOS[semitones];
+    }
+    int fifths = FIFTHS_ABOVE_TONIC[semitones];
+    if (degree != 0) {
+        fifths = DEGREE_FIFTHS[degree - 1] + 7 * (semitones - MODES[0].steps[degree - 1]);
+    }
+    // Stack the fifths, then bring the result back into the octave above the tonic.
+    double ratio = pow(TUNINGS[tuning].fifth, fifths);
+    while (ratio >= 2) {
+        ratio /= 2;
+    }
+    while (ratio < 1) {
+        ratio *= 2;
+    }
+    return ratio;
+}
+
+// Returns the index into TUNINGS of the named tuning, or -1 if there isn't one.
+int getTuning(string name) {
+    for (int i = 0; i < NUM_TUNINGS; i++) {
+        if (TUNINGS[i].name == name) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Returns the interval between two notes as an integer. 
+int getInterval(int note1, int note2) {
+    // /10 & %10 because notes 1 & 2 are exclusively for two digit numbers.
+    // Note that the + 1 posInt is to adhere to music notation that the interval
+    // from a note to itself (C0 to C0 for example) is one.The sevens account
+    // for multi - octave intervals.
+    int first = 7 * (note1 / 10) + (note1 % 10);
+    int second = 7 * (note2 / 10) + (note2 % 10);
+    return abs(first - second) + 1;
+}
+
+// Reduces an interval to its smallest form... (e.g. 10 -> 3)
+int reduceInterval(int interval) {
+    if (interval <= 7) {
+        return interval;
+    }
+    return reduceInterval(interval - 7);
+}
+
+// Returns true if provided interval is consonant, false otherwise.
+bool isConsonant(int interval) {
+    int redInt = reduceInterval(interval);
+    if (redInt == 1 || redInt == 3 || redInt == 5 || redInt == 6) {
+        return true;
+    }
+    return false;
+}
+
+// Returns the MIDI note of a 2-digit note in musicKey, the reverse of notePos().
+int getPitch(int note, MusicKey musicKey) {
+    // The octave digit counts from the tonic in MIDI octave 0 (C-1).
+    return 12 * (note / 10) + musicKey.tonic + MODES[musicKey.mode].steps[note % 10 - 1];
+}
+
+// Returns false if raising a VII to the leading tone turns the interval between the two notes
+// augmented or diminished. cadence1 and cadence2 say which notes come right before the final one.
+bool isAllowedLeadingTone(int note1, bool cadence1, int note2, bool cadence2, MusicKey musicKey) {
+    int raise = MODES[musicKey.mode].leadingToneRaise;
+    bool raised1 = raise != 0 && cadence1 && note1 % 10 == 7;
+    bool raised2 = raise != 0 && cadence2 && note2 % 10 == 7;
+    // Any other interval is the mode's own, tritones and all.
+    if (raised1 == raised2) {
+        return true;
+    }
+    int pitch1 = getPitch(note1, musicKey) + (raised1 ? raise : 0);
+    int pitch2 = getPitch(note2, musicKey) + (raised2 ? raise : 0);
+    return isDiatonicInterval(getInterval(note1, note2), abs(pitch1 - pitch2));
+}
+
+// Returns true if an interval (unison = 1) spanning semitones is major, minor or perfect.
+bool isDiatonicInterval(int interval, int semitones) {
+    int simple = (interval - 1) % 7;
+    int extra = semitones % 12 - INTERVAL_SEMITONES[simple];
+    return extra == 0 || (extra == 1 && !PERFECT_INTERVALS[simple]);
+}
+
+/**************************************************************************************************
+*                                  CONSTRAINT SATISFACTION                                        *
+**************************************************************************************************/
+
+// Checks all available notes against cantus constraints and returns all valid cantus notes as a
+// map from int (note position / octave) to int (MIDI note).
+map<int, int> getAllowedCantusNotes(map<int, int> notes, MusicKey musicKey, int prevNotes[],
+    int noteNum, int totalNotes) {
+    map<int, int> allowedNotes;
+    // Start with the tonic.
+    if (noteNum == 1) {
+        for (auto it : notes) {
+            if (it.first % 10 == 1) {
+                allowedNotes[it.first] = it.second;
+            }
+        }
+    }
+    // End with the tonic, but it should be stepwise from the last note... so we'll get
+    // to the last note needing to be II or VII. 
+    else if (noteNum == totalNotes) {
+        for (auto it : notes) {
+            int interval = getInterval(prevNotes[0], it.first);
+            if ((interval == 2) && (it.first % 10 == 1)) {
+                allowedNotes[it.first] = it.second;
+            }
+        }
+    }
+    // Second to last note must be II or VII, and i don't want leaps larger than a sixth. Nor
+    // any that raising VII to the leading tone would make augmented or diminished.
+    else if (noteNum == totalNotes - 1) {
+        for (auto it : notes) {
+            int interval = getInterval(prevNotes[0], it.first);
+            if ((interval <= 6) && ((it.first % 10 == 2) || (it.first % 10 == 7)) &&
+                    isAllowedLeadingTone(prevNotes[0], false, it.first, true, musicKey)) {
+                allowedNotes[it.first] = it.second;
+            }
+        }
+    }
+    // Second note will have prev[1] = -1.
+    else if (prevNotes[1] == -1) {
+        for (auto it : notes) {
+            int interval = getInterval(prevNotes[0], it.first);
+            // Just don't leap too far.
+            if (interval <= 6) {
+                allowedNotes[it.first] = it.second;
             }
         }
     }
@@ -578,11 +1804,11 @@ map<int, float> getAllowedCantusNotes(map<int, float> notes, int prevNotes[],
 }
 
 // Checks all available notes against ctrpt constraints and returns all valid ctrpt notes as a map
-// from int(note position / octave) to float (note frequency).
-map<int, float> getAllowedCtrptNotes(vector<int> ctrptNotes, vector<int> cantusNotes,
-    map<int, float> notes) {
+// from int(note position / octave) to int (MIDI note).
+map<int, int> getAllowedCtrptNotes(vector<int> ctrptNotes, vector<int> cantusNotes,
+    map<int, int> notes, MusicKey musicKey) {
     // Initialize map of allowed notes.
-    map<int, float> allowedCtrptNotes;
+    map<int, int> allowedCtrptNotes;
 
     // First note must be tonic.
     if (ctrptNotes.size() == 0) {
@@ -598,9 +1824,10 @@ map<int, float> getAllowedCtrptNotes(vector<int> ctrptNotes, vector<int> cantusN
     if (ctrptNotes.size() == cantusNotes.size() - 2) {
         // Cantus note is ii...
         if (cantusNotes.end()[-2] % 10 == 2) {
-            // So vii is allowed.
+            // So vii is allowed, as long as the leap into it is still one once it's raised.
             for (auto it : notes) {
-                if (it.first % 10 == 7) {
+                if (it.first % 10 == 7 &&
+                        isAllowedLeadingTone(ctrptNotes.back(), false, it.first, true, musicKey)) {
                     allowedCtrptNotes[it.first] = it.second;
                 }
             }
@@ -627,6 +1854,16 @@ map<int, float> getAllowedCtrptNotes(vector<int> ctrptNotes, vector<int> cantusN
         return allowedCtrptNotes;
     }
 
+    return getAllowedMidCtrptNotes(ctrptNotes, cantusNotes, notes);
+}
+
+// Checks all available notes against the ctrpt constraints that apply away from the opening
+// and the cadence. Returns all valid ctrpt notes as a map from int (note position / octave)
+// to int (MIDI note).
+map<int, int> getAllowedMidCtrptNotes(vector<int> ctrptNotes, vector<int> cantusNotes,
+    map<int, int> notes) {
+    map<int, int> allowedCtrptNotes;
+
     // Need to compare ctrpt notes to cantus notes to determine which notes are allowed.
     // Add every note that forms a consonance with the cantus and then prune the list based
     // on previous ctrpt notes and previous intervals formed between the two melodies.
@@ -660,8 +1897,130 @@ map<int, float> getAllowedCtrptNotes(vector<int> ctrptNotes, vector<int> cantusN
     return allowedCtrptNotes;
 }
 
+// Checks all available notes against the second, third or fourth species constraints for the
+// next cell of the grid and returns all valid ones as a map from int to int (MIDI note).
+// Every cantus note is split into SPECIES_SUBDIVISIONS[species] cells, the first of which is the
+// strong beat.
+map<int, int> getAllowedSpeciesNotes(vector<int> grid, vector<int> cantusNotes,
+    map<int, int> notes, MusicKey musicKey, int species) {
+    map<int, int> allowedNotes;
+    int subdivisions = SPECIES_SUBDIVISIONS[species];
+    unsigned cell = grid.size();
+    unsigned lastCell = (cantusNotes.size() - 1) * subdivisions;
+    bool strong = cell % subdivisions == 0;
+    // Parallels are checked between the beats where new notes come in: the strong beats, or the
+    // weak beats in fourth species.
+    bool attack = (species == 4) != strong;
+
+    for (auto it : notes) {
+        int note = it.first;
+        if (!isAllowedSpeciesNote(cantusNotes, note, cell, species)) {
+            continue;
+        }
+        if (cell == 0) {
+            allowedNotes[it.first] = it.second;
+            continue;
+        }
+        int prev = grid.back();
+        if (!isAllowedSpeciesStep(cantusNotes, prev, note, cell, species, musicKey)) {
+            continue;
+        }
+
+        // Dissonances are approached by step and left by step. In fourth species that means a
+        // suspension resolving down, otherwise a passing tone carrying on in the same direction,
+        // or in third species also a neighbour tone stepping back.
+        int prevCantusNote = cantusNotes[(cell - 1) / subdivisions];
+        if (!isConsonant(getInterval(prevCantusNote, prev))) {
+            bool stepwise = getInterval(prev, note) == 2;
+            bool resolved;
+            if (species == 4) {
+                resolved = stepwise && note < prev;
+            }
+            else {
+                bool passing = (note > prev) == (prev > grid.end()[-2]);
+                bool neighbour = species == 3 && note == grid.end()[-2];
+                resolved = stepwise && (passing || neighbour);
+            }
+            if (!resolved) {
+                continue;
+            }
+        }
+        // In second and third species a dissonance must also be approached by step.
+        int cantusInterval = getInterval(cantusNotes[cell / subdivisions], note);
+        if (species != 4 && !isConsonant(cantusInterval) && getInterval(prev, note) != 2) {
+            continue;
+        }
+
+        // No parallel fifths or octaves from one attack to the next.
+        if ((attack || cell == lastCell) && cell >= (unsigned)subdivisions) {
+            int prevInterval = reduceInterval(getInterval(cantusNotes[cell / subdivisions - 1],
+                grid[cell - subdivisions]));
+            if ((prevInterval == 5 || prevInterval == 1) &&
+                    reduceInterval(cantusInterval) == prevInterval) {
+                continue;
+            }
+        }
+        allowedNotes[it.first] = it.second;
+    }
+    return allowedNotes;
+}
+
+// Returns true if the note is allowed in cell on its own.
+bool isAllowedSpeciesNote(vector<int>& cantusNotes, int note, unsigned cell, int species) {
+    int subdivisions = SPECIES_SUBDIVISIONS[species];
+    unsigned lastCell = (cantusNotes.size() - 1) * subdivisions;
+    int cantusNote = cantusNotes[cell / subdivisions];
+    int cantusInterval = getInterval(cantusNote, note);
+    bool strong = cell % subdivisions == 0;
+    bool ends = cell == 0 || cell == lastCell;
+
+    // Stay under the cantus (unisons only at the ends) and within a twelfth.
+    if (note > cantusNote || (note == cantusNote && !ends) || cantusInterval > 12) {
+        return false;
+    }
+    // Start and end with the tonic.
+    if (ends) {
+        return note % 10 == 1;
+    }
+    // The note before the last is VII against a II in the cantus and II otherwise.
+    if (cell == lastCell - 1) {
+        int leadingDegree = cantusNotes.end()[-2] % 10 == 2 ? 7 : 2;
+        if (note % 10 != leadingDegree) {
+            return false;
+        }
+    }
+    // Strong beats are consonant, except for fourth species suspensions where it's the weak
+    // beats instead.
+    if ((species == 4) != strong) {
+        return isConsonant(cantusInterval);
+    }
+    return true;
+}
+
+// Returns true if the ctrpt may move from prevNote in the cell before to note in cell.
+bool isAllowedSpeciesStep(vector<int>& cantusNotes, int prevNote, int note, unsigned cell,
+    int species, MusicKey musicKey) {
+    int subdivisions = SPECIES_SUBDIVISIONS[species];
+    unsigned lastCell = (cantusNotes.size() - 1) * subdivisions;
+    int interval = getInterval(prevNote, note);
+    // End with the tonic, by step.
+    if (cell == lastCell) {
+        return interval == 2;
+    }
+    // Raising VII to the leading tone mustn't make the move into it augmented or diminished.
+    if (cell == lastCell - 1 && !isAllowedLeadingTone(prevNote, false, note, true, musicKey)) {
+        return false;
+    }
+    // Fourth species strong beats are tied over from the weak beat before.
+    if (species == 4) {
+        return cell % subdivisions != 0 ? interval <= 6 : note == prevNote;
+    }
+    // No repeated notes, and don't leap further than a sixth.
+    return note != prevNote && interval <= 6;
+}
+
 // Imposes constraint on ctrptNotes.
-void removeParallelFifths(map<int, float>& allowedCtrptNotes, vector<int> ctrptNotes, vector<int> cantusNotes) {
+void removeParallelFifths(map<int, int>& allowedCtrptNotes, vector<int> ctrptNotes, vector<int> cantusNotes) {
     if (allowedCtrptNotes.size() == 0) {
         return;
     }
@@ -685,7 +2044,7 @@ void removeParallelFifths(map<int, float>& allowedCtrptNotes, vector<int> ctrptN
 }
 
 // Imposes constraint on ctrptNotes.
-void removeParallelEighths(map<int, float>& allowedCtrptNotes, vector<int> ctrptNotes, vector<int> cantusNotes) {
+void removeParallelEighths(map<int, int>& allowedCtrptNotes, vector<int> ctrptNotes, vector<int> cantusNotes) {
     if (allowedCtrptNotes.size() == 0) {
         return;
     }
@@ -709,7 +2068,7 @@ void removeParallelEighths(map<int, float>& allowedCtrptNotes, vector<int> ctrpt
 }
 
 // Imposes constraint on ctrptNotes.
-void remove3xLeap(map<int, float>& allowedCtrptNotes, vector<int> ctrptNotes) {
+void remove3xLeap(map<int, int>& allowedCtrptNotes, vector<int> ctrptNotes) {
     if (allowedCtrptNotes.size() == 0) {
         return;
     }
@@ -731,7 +2090,7 @@ void remove3xLeap(map<int, float>& allowedCtrptNotes, vector<int> ctrptNotes) {
 }
 
 // Imposes constraint on ctrptNotes.
-void removeOppositeLeaps(map<int, float>& allowedCtrptNotes, vector<int> ctrptNotes) {
+void removeOppositeLeaps(map<int, int>& allowedCtrptNotes, vector<int> ctrptNotes) {
     if (allowedCtrptNotes.size() == 0) {
         return;
     }
@@ -755,7 +2114,7 @@ void removeOppositeLeaps(map<int, float>& allowedCtrptNotes, vector<int> ctrptNo
 }
 
 // Imposes constraint on ctrptNotes.
-void remove4xIntervalOrNote(map<int, float>& allowedCtrptNotes, vector<int> ctrptNotes,
+void remove4xIntervalOrNote(map<int, int>& allowedCtrptNotes, vector<int> ctrptNotes,
     vector<int> cantusNotes) {
     if (allowedCtrptNotes.size() == 0) {
         return;
@@ -789,7 +2148,7 @@ void remove4xIntervalOrNote(map<int, float>& allowedCtrptNotes, vector<int> ctrp
 }
 
 // Returns a list of keys from a given map.
-vector<int> getKeyList(map<int, float> notes) {
+vector<int> getKeyList(map<int, int> notes) {
     vector<int> keyList;
     for (auto it : notes) {
         keyList.push_back(it.first);
@@ -797,6 +2156,777 @@ vector<int> getKeyList(map<int, float> notes) {
     return keyList;
 }
 
+/**************************************************************************************************
+*                                         STREAMING                                               *
+**************************************************************************************************/
+
+// Writes a .csd that plays score events read from stdin in real time.
+void writeStreamFile(string filename) {
+    ofstream myfile = startFile(filename, "-odac -L stdin");
+    if (myfile.is_open()) {
+        // Keep the performance running until Csound is stopped.
+        myfile << "f 0 z\n";
+        myfile << "</CsScore>\n";
+        myfile << "</CsoundSynthesizer>";
+    }
+    endFile(myfile);
+}
+
+// Generates cantus and ctrpt together measure by measure and writes each measure to stdout as
+// real-time score events once it is proven continuable. Stops after a cadence, which is written
+// when requested or after maxMeasures (0 for no limit).
+void streamMelody(MusicKey musicKey, int tempo, int maxMeasures, int lookahead) {
+    map<int, int> cantusNotes = getNotes(musicKey, ALTO);
+    map<int, int> ctrptNotes = getNotes(musicKey, TENOR);
+    double beatSeconds = 60.0 / tempo;
+    chrono::microseconds measureLength((long long)(beatSeconds * NOTES_PER_MEASURE * 1e6));
+
+    // No rule looks back more than three notes, so that's all we keep of the committed melodies.
+    const unsigned contextSize = 3;
+    vector<int> cantusContext;
+    vector<int> ctrptContext;
+    // Continuation proven by the last window, to fall back on if the next search fails.
+    vector<int> cantusTail;
+    vector<int> ctrptTail;
+
+    listenForCadence();
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    int measure = 0;
+    bool done = false;
+    while (!done) {
+        bool cadence = cadenceRequested || (maxMeasures > 0 && measure >= maxMeasures - 1);
+        int windowEnd = cantusContext.size() + NOTES_PER_MEASURE + (cadence ? 0 : lookahead);
+        vector<int> cantusWindow = cantusContext;
+        vector<int> ctrptWindow = ctrptContext;
+        vector<int> cantusMeasure;
+        vector<int> ctrptMeasure;
+
+        if (fillStreamWindow(cantusWindow, ctrptWindow, cantusNotes, ctrptNotes, musicKey,
+                windowEnd, cadence)) {
+            int measureEnd = cantusContext.size() + NOTES_PER_MEASURE;
+            cantusMeasure.assign(cantusWindow.begin() + cantusContext.size(),
+                cantusWindow.begin() + measureEnd);
+            ctrptMeasure.assign(ctrptWindow.begin() + ctrptContext.size(),
+                ctrptWindow.begin() + measureEnd);
+            cantusTail.assign(cantusWindow.begin() + measureEnd, cantusWindow.end());
+            ctrptTail.assign(ctrptWindow.begin() + measureEnd, ctrptWindow.end());
+            done = cadence;
+        }
+        else if (cantusTail.size() >= NOTES_PER_MEASURE) {
+            // The previous window already proved this measure can be continued.
+            cantusMeasure.assign(cantusTail.begin(), cantusTail.begin() + NOTES_PER_MEASURE);
+            ctrptMeasure.assign(ctrptTail.begin(), ctrptTail.begin() + NOTES_PER_MEASURE);
+            cantusTail.erase(cantusTail.begin(), cantusTail.begin() + NOTES_PER_MEASURE);
+            ctrptTail.erase(ctrptTail.begin(), ctrptTail.begin() + NOTES_PER_MEASURE);
+        }
+        else {
+            // Dead end - start a new phrase on the tonic.
+            cerr << "Stream reached a dead end, starting a new phrase.\n";
+            cantusContext.clear();
+            ctrptContext.clear();
+            cantusTail.clear();
+            ctrptTail.clear();
+            continue;
+        }
+
+        this_thread::sleep_until(start + measure * measureLength);
+        writeStreamMeasure(cantusMeasure, ctrptMeasure, cantusNotes, ctrptNotes, musicKey, done,
+            beatSeconds);
+
+        cantusContext.insert(cantusContext.end(), cantusMeasure.begin(), cantusMeasure.end());
+        ctrptContext.insert(ctrptContext.end(), ctrptMeasure.begin(), ctrptMeasure.end());
+        cantusContext.erase(cantusContext.begin(), cantusContext.end() - contextSize);
+        ctrptContext.erase(ctrptContext.begin(), ctrptContext.end() - contextSize);
+        measure += 1;
+    }
+}
+
+// Extends both windows (which start out holding the committed context) to windowEnd notes.
+// Returns false if no continuation was found within the node budget.
+bool fillStreamWindow(vector<int>& cantusWindow, vector<int>& ctrptWindow,
+    map<int, int> cantusNotes, map<int, int> ctrptNotes, MusicKey musicKey, int windowEnd,
+    bool cadence) {
+    TraceSpan span("fillStreamWindow");
+    vector<int> cantusContext = cantusWindow;
+    vector<int> ctrptContext = ctrptWindow;
+    mt19937 rng(rand());
+    // Never set, the stream solves one window at a time.
+    atomic<bool> solved(false);
+
+    // Try a few cantus lines, giving each an equal share of the budget.
+    for (int attempt = 0; attempt < STREAM_CANTUS_ATTEMPTS; attempt++) {
+        long budget = STREAM_NODE_BUDGET / STREAM_CANTUS_ATTEMPTS;
+        cantusWindow = cantusContext;
+        ctrptWindow = ctrptContext;
+        if (extendCantusWindow(cantusWindow, cantusNotes, musicKey, windowEnd, cadence) &&
+                backtrackFillCtrptTask(ctrptWindow, ctrptNotes, musicKey, cantusWindow, rng, solved,
+                    cadence, budget)) {
+            return true;
+        }
+    }
+    cantusWindow = cantusContext;
+    ctrptWindow = ctrptContext;
+    return false;
+}
+
+// Randomly extends the cantus window to windowEnd notes. Returns false on a dead end.
+bool extendCantusWindow(vector<int>& cantusWindow, map<int, int> notes, MusicKey musicKey,
+    int windowEnd, bool cadence) {
+    // Without a cadence the phrase never ends as far as the cantus rules are concerned.
+    int totalNotes = cadence ? windowEnd : INT_MAX;
+    while ((int)cantusWindow.size() < windowEnd) {
+        int prevNotes[] = { -1, -1 };
+        if (cantusWindow.size() >= 1) {
+            prevNotes[0] = cantusWindow.end()[-1];
+        }
+        if (cantusWindow.size() >= 2) {
+            prevNotes[1] = cantusWindow.end()[-2];
+        }
+        map<int, int> allowedNotes = getAllowedCantusNotes(notes, musicKey, prevNotes,
+            cantusWindow.size() + 1, totalNotes);
+        if (allowedNotes.size() == 0) {
+            return false;
+        }
+        cantusWindow.push_back(randomNoteKey(getKeyList(allowedNotes)));
+    }
+    return true;
+}
+
+// Writes one measure of both voices to stdout as real-time score events. Line events are timed
+// in seconds from when Csound reads them.
+void writeStreamMeasure(vector<int> cantusMeasure, vector<int> ctrptMeasure,
+    map<int, int> cantusNotes, map<int, int> ctrptNotes, MusicKey musicKey, bool cadence,
+    double beatSeconds) {
+    TraceSpan span("writeStreamMeasure");
+    vector<float> cantusFreqs = getMelodyFrequencies(cantusMeasure, cantusNotes, musicKey, cadence);
+    vector<float> ctrptFreqs = getMelodyFrequencies(ctrptMeasure, ctrptNotes, musicKey, cadence);
+    for (unsigned i = 0; i < cantusFreqs.size(); i++) {
+        cout << "i1 " << i * beatSeconds << " " << beatSeconds << " " << cantusFreqs[i] << "\n";
+    }
+    for (unsigned i = 0; i < ctrptFreqs.size(); i++) {
+        cout << "i2 " << i * beatSeconds << " " << beatSeconds << " " << ctrptFreqs[i] << "\n";
+    }
+    cout << flush;
+}
+
+// Requests a cadence once a line is read from stdin.
+void listenForCadence() {
+    thread([]() {
+        string line;
+        if (getline(cin, line)) {
+            cadenceRequested = true;
+        }
+    }).detach();
+}
+
+/**************************************************************************************************
+*                                           BATCH                                                 *
+**************************************************************************************************/
+
+// Writes count different pieces to counterpoint_0.csd, counterpoint_1.csd, ... using numThreads
+// threads. Pieces already written are thrown away without touching the disk. Stops early once the
+// estimated chance of the next piece being new falls below stopEstimate (0 to never stop early).
+void writeBatch(int count, MusicKey musicKey, int numMeasures, int tempo, int numThreads,
+    double stopEstimate) {
+    map<int, int> cantusRange = getNotes(musicKey, ALTO);
+    map<int, int> ctrptRange = getNotes(musicKey, TENOR);
+    int totalNotes = calcTotalNotes(numMeasures);
+    long maxAttempts = count * BATCH_ATTEMPTS_PER_PIECE;
+
+    vector<FingerprintShard> shards(BATCH_SHARDS);
+    atomic<int> written(0);
+    // Every try counts toward the cap, pieces only counts the ones that solved.
+    atomic<long> attempts(0);
+    atomic<long> pieces(0);
+    // Pieces generated exactly once so far. By Good-Turing, singletons / pieces estimates the
+    // chance that the next piece is one that hasn't been generated yet.
+    atomic<long> singletons(0);
+    atomic<bool> exhausted(false);
+
+    mt19937 seeder(rand());
+    vector<thread> workers;
+    for (int i = 0; i < numThreads; i++) {
+        unsigned seed = seeder();
+        workers.push_back(thread([&, seed]() {
+            mt19937 rng(seed);
+            // Never set, the batch solves one melody at a time per thread.
+            atomic<bool> solved(false);
+            while (written < count && !exhausted && attempts++ < maxAttempts) {
+                vector<int> cantusNotes = generateCantusMelody(cantusRange, musicKey, totalNotes,
+                    rng);
+                if (cantusNotes.size() == 0) {
+                    continue;
+                }
+                vector<int> ctrptNotes;
+                if (!backtrackFillCtrptTask(ctrptNotes, ctrptRange, musicKey, cantusNotes, rng,
+                        solved)) {
+                    continue;
+                }
+
+                long tries = ++pieces;
+                int seen = addFingerprint(shards, fingerprintPiece(cantusNotes, ctrptNotes));
+                long unseen = seen == 1 ? ++singletons : seen == 2 ? --singletons :
+                    singletons.load();
+                if (seen == 1) {
+                    int index = written++;
+                    if (index < count) {
+                        writeBatchPiece("counterpoint_" + to_string(index) + ".csd", musicKey,
+                            tempo, cantusNotes, ctrptNotes, cantusRange, ctrptRange);
+                    }
+                }
+                if (stopEstimate > 0 && tries >= BATCH_MIN_ATTEMPTS &&
+                        (double)unseen / tries < stopEstimate) {
+                    exhausted = true;
+                }
+            }
+        }));
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    int unique = min((int)written, count);
+    cout << "Wrote " << unique << " pieces in " << min((long)attempts, maxAttempts)
+        << " attempts (" << pieces - written << " duplicates).\n";
+    if (exhausted) {
+        cout << "Stopped early, the next piece only had about a "
+            << 100.0 * singletons / max((long)pieces, 1L) << "% chance of being new.\n";
+    }
+    else if (unique < count) {
+        cout << "Gave up after " << maxAttempts << " attempts.\n";
+    }
+}
+
+// Writes one finished piece to its own file.
+void writeBatchPiece(string filename, MusicKey musicKey, int tempo, vector<int> cantusNotes,
+    vector<int> ctrptNotes, map<int, int> cantusRange, map<int, int> ctrptRange) {
+    ofstream myfile = startFile(filename);
+    if (myfile.is_open()) {
+        myfile << "t 0 " << tempo << endl << endl;
+        vector<float> cantusFreqs = getMelodyFrequencies(cantusNotes, cantusRange, musicKey, true);
+        for (unsigned i = 0; i < cantusFreqs.size(); i++) {
+            myfile << "i1 " << i << " 1 " << cantusFreqs[i] << endl;
+        }
+        vector<float> ctrptFreqs = getMelodyFrequencies(ctrptNotes, ctrptRange, musicKey, true);
+        for (unsigned i = 0; i < ctrptFreqs.size(); i++) {
+            myfile << "i2 " << i << " 1 " << ctrptFreqs[i] << endl;
+        }
+        myfile << "</CsScore>\n";
+        myfile << "</CsoundSynthesizer>";
+    }
+    endFile(myfile);
+}
+
+// Returns a hash of both melodies' degrees, so pieces that only differ in key share a fingerprint.
+unsigned long long fingerprintPiece(vector<int>& cantusNotes, vector<int>& ctrptNotes) {
+    // FNV-1a over every note, with -1 between the two melodies.
+    unsigned long long hash = 14695981039346656037ULL;
+    vector<int> notes = cantusNotes;
+    notes.push_back(-1);
+    notes.insert(notes.end(), ctrptNotes.begin(), ctrptNotes.end());
+    for (auto note : notes) {
+        for (int byte = 0; byte < 4; byte++) {
+            hash ^= (note >> (8 * byte)) & 0xff;
+            hash *= 1099511628211ULL;
+        }
+    }
+    return hash;
+}
+
+// Adds the fingerprint to the set and returns how many times it has been added, this time
+// included.
+int addFingerprint(vector<FingerprintShard>& shards, unsigned long long fingerprint) {
+    // The low bits pick the bucket inside the shard, so use the high ones to pick the shard.
+    FingerprintShard& shard = shards[(fingerprint >> 32) % shards.size()];
+    lock_guard<mutex> guard(shard.lock);
+    return ++shard.counts[fingerprint];
+}
+
+/**************************************************************************************************
+*                                        VERIFICATION                                             *
+**************************************************************************************************/
+
+// Solves a random cantus in a random key, mode and length per iteration with the serial and
+// parallel ctrpt solvers and checks every melody against the rules from scratch. Short pieces
+// also have their solutions counted both ways. Case i is seeded with seed + i, which is printed
+// for every failure so --verify 1 <seed> replays it. Returns false if anything failed.
+bool verifySolvers(int iterations, unsigned seed) {
+    // Load the notes of every key once up front.
+    vector<MusicKey> keys;
+    vector<map<int, int> > cantusRanges;
+    vector<map<int, int> > ctrptRanges;
+    for (int tonic = 0; tonic < 12; tonic++) {
+        for (int mode = 0; mode < NUM_MODES; mode++) {
+            keys.push_back(lookupMusicKey(KEY_NAMES[tonic] + " " + MODES[mode].name));
+            cantusRanges.push_back(getNotes(keys.back(), ALTO));
+            ctrptRanges.push_back(getNotes(keys.back(), TENOR));
+        }
+    }
+
+    int unsolvable = 0;
+    int counted = 0;
+    int mismatched = 0;
+    int failures = 0;
+    for (int i = 0; i < iterations; i++) {
+        unsigned caseSeed = seed + i;
+        srand(caseSeed);
+        int key = rand() % keys.size();
+        int totalNotes = calcTotalNotes(1 + rand() % VERIFY_MAX_MEASURES);
+        vector<int> cantusNotes;
+        do {
+            cantusNotes = generateCantusMelody(cantusRanges[key], keys[key], totalNotes);
+        } while (cantusNotes.size() == 0);
+
+        // Everything wrong with this case, one line each.
+        vector<string> problems;
+        string broken = checkCantusMelody(cantusNotes, cantusRanges[key], keys[key]);
+        if (broken != "") {
+            problems.push_back("cantus: " + broken);
+        }
+
+        vector<int> serial;
+        serial = backtrackFillCtrptMelody(serial, ctrptRanges[key], keys[key], cantusNotes);
+        vector<int> parallel = parallelFillCtrptMelody(ctrptRanges[key], keys[key], cantusNotes,
+            VERIFY_THREADS);
+        bool serialSolved = serial.back() != -1;
+        bool parallelSolved = parallel.back() != -1;
+        // The known discrepancy in this case, one line each. getAllowedMidCtrptNotes() measures
+        // a note against the cantus note before its own, which is only reported.
+        vector<string> known;
+        vector<pair<string, vector<int> > > solutions;
+        if (serialSolved) {
+            solutions.push_back(make_pair(string("serial"), serial));
+        }
+        if (parallelSolved) {
+            solutions.push_back(make_pair(string("parallel"), parallel));
+        }
+        for (auto solution : solutions) {
+            broken = checkCtrptMelody(solution.second, cantusNotes, ctrptRanges[key], keys[key],
+                0);
+            if (broken == "") {
+                continue;
+            }
+            if (checkCtrptMelody(solution.second, cantusNotes, ctrptRanges[key], keys[key],
+                    1) == "") {
+                known.push_back("known: " + solution.first + " ctrpt: " + broken +
+                    " measured against its own cantus note");
+            }
+            else {
+                problems.push_back(solution.first + " ctrpt: " + broken);
+            }
+        }
+        // Both searches are exhaustive, so they must agree on whether there is a solution.
+        if (serialSolved != parallelSolved) {
+            problems.push_back(string("serial ") + (serialSolved ? "solved" : "failed") +
+                " but parallel " + (parallelSolved ? "solved" : "failed"));
+        }
+        if (!serialSolved && !parallelSolved) {
+            unsolvable += 1;
+        }
+
+        if (cantusNotes.size() <= VERIFY_COUNT_NOTES) {
+            vector<int> ctrptNotes;
+            long solverCount = countCtrptMelodies(ctrptNotes, ctrptRanges[key], keys[key],
+                cantusNotes, VERIFY_COUNT_LIMIT);
+            long checkedCount = countCheckedMelodies(ctrptNotes, ctrptRanges[key], keys[key],
+                cantusNotes, 0, VERIFY_COUNT_LIMIT);
+            if (solverCount != checkedCount) {
+                long laggedCount = countCheckedMelodies(ctrptNotes, ctrptRanges[key], keys[key],
+                    cantusNotes, 1, VERIFY_COUNT_LIMIT);
+                string counts = "solver finds " + to_string(solverCount) + " melodies but " +
+                    to_string(checkedCount) + " follow the rules";
+                if (solverCount == laggedCount) {
+                    known.push_back("known: " + counts);
+                }
+                else {
+                    problems.push_back(counts);
+                }
+            }
+            if (serialSolved != (solverCount > 0)) {
+                problems.push_back("serial " + string(serialSolved ? "solved" : "failed") +
+                    " with " + to_string(solverCount) + " melodies possible");
+            }
+            counted += 1;
+        }
+        if (known.size() > 0) {
+            mismatched += 1;
+        }
+
+        if (problems.size() > 0) {
+            failures += 1;
+            cout << "case " << i << " seed " << caseSeed << " key " << KEY_NAMES[key / NUM_MODES]
+                << " " << MODES[key % NUM_MODES].name << "\n";
+            cout << "  cantus:";
+            for (auto note : cantusNotes) {
+                cout << " " << note;
+            }
+            cout << "\n  ctrpt: ";
+            for (auto note : serial) {
+                cout << " " << note;
+            }
+            cout << "\n";
+            for (auto problem : problems) {
+                cout << "  " << problem << "\n";
+            }
+            for (auto line : known) {
+                cout << "  " << line << "\n";
+            }
+        }
+    }
+
+    cout << iterations << " cases, " << unsolvable << " without a ctrpt, " << counted
+        << " counted, " << mismatched << " with the known cantus mismatch, " << failures
+        << " failed (seeds " << seed << " - " << seed + iterations - 1 << ")\n";
+    return failures == 0;
+}
+
+// Returns the first cantus rule the melody breaks, or "" if it follows them all.
+string checkCantusMelody(vector<int>& cantusNotes, map<int, int>& notes, MusicKey musicKey) {
+    unsigned total = cantusNotes.size();
+    for (unsigned i = 0; i < total; i++) {
+        int note = cantusNotes[i];
+        string at = " at note " + to_string(i + 1);
+        if (notes.count(note) == 0) {
+            return "out of range" + at;
+        }
+        if (i == 0) {
+            if (note % 10 != 1) {
+                return "doesn't start on the tonic";
+            }
+            continue;
+        }
+
+        // Size of the move into this note in scale steps, and which way it goes.
+        int prev = cantusNotes[i - 1];
+        int move = abs((7 * (note / 10) + note % 10) - (7 * (prev / 10) + prev % 10));
+        int direction = note > prev ? 1 : note < prev ? -1 : 0;
+        if (i == total - 1) {
+            if (note % 10 != 1 || move != 1) {
+                return "doesn't end on the tonic by step";
+            }
+        }
+        else if (i == total - 2) {
+            if (note % 10 != 2 && note % 10 != 7) {
+                return "second to last note isn't II or VII";
+            }
+            if (move > 5) {
+                return "leap larger than a sixth" + at;
+            }
+            if (isAlteredLeadingToneLeap(prev, note, notes, musicKey)) {
+                return "augmented or diminished leap into the leading tone";
+            }
+        }
+        else if (i == 1) {
+            if (move > 5) {
+                return "leap larger than a sixth" + at;
+            }
+        }
+        else {
+            int prevPrev = cantusNotes[i - 2];
+            int prevMove = abs((7 * (prev / 10) + prev % 10) -
+                (7 * (prevPrev / 10) + prevPrev % 10));
+            int prevDirection = prev > prevPrev ? 1 : -1;
+            if (prevMove == 0 && (move == 0 || move > 5)) {
+                return "repeated note not left by a step or leap up to a sixth" + at;
+            }
+            if (prevMove == 1 && move > 5) {
+                return "leap larger than a sixth" + at;
+            }
+            if (prevMove == 2 && move > 1) {
+                return "third not followed by a step or repeat" + at;
+            }
+            if (prevMove >= 3 && (move != 1 || direction == prevDirection)) {
+                return "large leap not followed by a step back" + at;
+            }
+        }
+    }
+    return "";
+}
+
+// Returns the first ctrpt rule the melody breaks, or "" if it follows them all. See
+// checkCtrptNote() for cantusLag.
+string checkCtrptMelody(vector<int>& ctrptNotes, vector<int>& cantusNotes,
+    map<int, int>& notes, MusicKey musicKey, unsigned cantusLag) {
+    if (ctrptNotes.size() != cantusNotes.size()) {
+        return "length " + to_string(ctrptNotes.size()) + " against a cantus of " +
+            to_string(cantusNotes.size());
+    }
+    for (unsigned i = 0; i < ctrptNotes.size(); i++) {
+        string broken = checkCtrptNote(ctrptNotes, cantusNotes, notes, musicKey, i, cantusLag);
+        if (broken != "") {
+            return broken + " at note " + to_string(i + 1);
+        }
+    }
+    return "";
+}
+
+// Returns the first ctrpt rule broken by the note at index given the notes before it, or "".
+// A note between the first and the cadence is measured against the cantus note cantusLag notes
+// before its own: 0 for the rules, 1 for the way getAllowedMidCtrptNotes() reads them.
+string checkCtrptNote(vector<int>& ctrptNotes, vector<int>& cantusNotes,
+    map<int, int>& notes, MusicKey musicKey, unsigned index, unsigned cantusLag) {
+    // Position of a note in scale steps.
+    auto steps = [](int note) {
+        return 7 * (note / 10) + note % 10;
+    };
+    // Interval number (unison = 1) between two notes, and the same reduced to within an octave.
+    auto interval = [&](int a, int b) {
+        return abs(steps(a) - steps(b)) + 1;
+    };
+    auto simple = [&](int a, int b) {
+        return (interval(a, b) - 1) % 7 + 1;
+    };
+
+    unsigned total = cantusNotes.size();
+    int note = ctrptNotes[index];
+    if (notes.count(note) == 0) {
+        return "out of range";
+    }
+    if (index == 0) {
+        return note % 10 == 1 ? "" : "doesn't start on the tonic";
+    }
+    if (index == total - 2) {
+        int wanted = cantusNotes[total - 2] % 10 == 2 ? 7 : 2;
+        if (note % 10 != wanted) {
+            return "wrong degree before the cadence";
+        }
+        return isAlteredLeadingToneLeap(ctrptNotes[index - 1], note, notes, musicKey) ?
+            "augmented or diminished leap into the leading tone" : "";
+    }
+    if (index == total - 1) {
+        return note % 10 == 1 && interval(ctrptNotes[index - 1], note) == 2 ? "" :
+            "doesn't end on the tonic by step";
+    }
+
+    int cantus = cantusNotes[index - cantusLag];
+    int prev = ctrptNotes[index - 1];
+    int withCantus = simple(cantus, note);
+    if (withCantus != 1 && withCantus != 3 && withCantus != 5 && withCantus != 6) {
+        return "dissonant with the cantus";
+    }
+    if (interval(cantus, note) > 12) {
+        return "more than a twelfth below the cantus";
+    }
+    if (note >= cantus) {
+        return "not below the cantus";
+    }
+    if (interval(prev, note) > 6) {
+        return "leap larger than a sixth";
+    }
+    int prevWithCantus = simple(cantusNotes[index - 1], prev);
+    if ((prevWithCantus == 5 || prevWithCantus == 1) && withCantus == prevWithCantus) {
+        return "parallel fifths or octaves";
+    }
+
+    if (index >= 2) {
+        int prevPrev = ctrptNotes[index - 2];
+        bool leap = interval(prev, note) >= 3;
+        bool prevLeap = interval(prevPrev, prev) >= 3;
+        if (leap && prevLeap && (note > prev) != (prev > prevPrev)) {
+            return "leap back after a leap";
+        }
+        if (index >= 3) {
+            int prevPrevPrev = ctrptNotes[index - 3];
+            if (leap && prevLeap && interval(prevPrevPrev, prevPrev) >= 3) {
+                return "three leaps in a row";
+            }
+            if (note == prev && prev == prevPrev && prevPrev == prevPrevPrev) {
+                return "same note four times";
+            }
+            int sameInterval = interval(prev, cantusNotes[index - 1]);
+            if (interval(note, cantus) == sameInterval &&
+                    interval(prevPrev, cantusNotes[index - 2]) == sameInterval &&
+                    interval(prevPrevPrev, cantusNotes[index - 3]) == sameInterval) {
+                return "same interval four times";
+            }
+        }
+    }
+    return "";
+}
+
+// Returns true if raising note, a VII before the final note, to the leading tone makes the leap
+// into it from prev augmented or diminished. Works from the MIDI notes in notes.
+bool isAlteredLeadingToneLeap(int prev, int note, map<int, int>& notes, MusicKey musicKey) {
+    int raise = MODES[musicKey.mode].leadingToneRaise;
+    if (raise == 0 || note % 10 != 7) {
+        return false;
+    }
+    int semitones = abs(notes[note] + raise - notes[prev]) % 12;
+    int steps = abs((7 * (note / 10) + note % 10) - (7 * (prev / 10) + prev % 10)) % 7;
+    int minor = INTERVAL_SEMITONES[steps];
+    return semitones != minor && (PERFECT_INTERVALS[steps] || semitones != minor + 1);
+}
+
+// Counts the ctrpt melodies backtrackFillCtrptMelody() can find, stopping at limit.
+long countCtrptMelodies(vector<int>& ctrptNotes, map<int, int>& notes, MusicKey musicKey,
+    vector<int>& cantusNotes, long limit) {
+    if (ctrptNotes.size() == cantusNotes.size()) {
+        return 1;
+    }
+    long count = 0;
+    for (auto it : getAllowedCtrptNotes(ctrptNotes, cantusNotes, notes, musicKey)) {
+        ctrptNotes.push_back(it.first);
+        count += countCtrptMelodies(ctrptNotes, notes, musicKey, cantusNotes, limit - count);
+        ctrptNotes.pop_back();
+        if (count >= limit) {
+            break;
+        }
+    }
+    return count;
+}
+
+// Counts the ctrpt melodies checkCtrptNote() allows by trying every note at every position,
+// stopping at limit.
+long countCheckedMelodies(vector<int>& ctrptNotes, map<int, int>& notes, MusicKey musicKey,
+    vector<int>& cantusNotes, unsigned cantusLag, long limit) {
+    if (ctrptNotes.size() == cantusNotes.size()) {
+        return 1;
+    }
+    long count = 0;
+    for (auto it : notes) {
+        ctrptNotes.push_back(it.first);
+        if (checkCtrptNote(ctrptNotes, cantusNotes, notes, musicKey, ctrptNotes.size() - 1,
+                cantusLag) == "") {
+            count += countCheckedMelodies(ctrptNotes, notes, musicKey, cantusNotes, cantusLag,
+                limit - count);
+        }
+        ctrptNotes.pop_back();
+        if (count >= limit) {
+            break;
+        }
+    }
+    return count;
+}
+
+/**************************************************************************************************
+*                                          TRACING                                                *
+**************************************************************************************************/
+
+TraceSpan::TraceSpan(const char* spanName, int depth) : name(spanName), arg(depth), start(-1) {
+    if (tracingEnabled && depth < traceDepth) {
+        getTraceBuffer()->openSpans += 1;
+        start = traceNow();
+    }
+}
+
+TraceSpan::~TraceSpan() {
+    if (start != -1) {
+        long long end = traceNow();
+        TraceBuffer* buffer = getTraceBuffer();
+        buffer->openSpans -= 1;
+        unsigned long long count = buffer->count.load(memory_order_relaxed);
+        TraceEvent event = { name, arg, buffer->openSpans, start, end };
+        buffer->events[count % TRACE_BUFFER_SIZE] = event;
+        // Publish the event to whoever reads the buffer.
+        buffer->count.store(count + 1, memory_order_release);
+    }
+}
+
+// Returns microseconds since the program started.
+long long traceNow() {
+    return chrono::duration_cast<chrono::microseconds>(
+        chrono::steady_clock::now() - traceEpoch).count();
+}
+
+// Returns this thread's trace buffer, registering a new one the first time.
+TraceBuffer* getTraceBuffer() {
+    if (traceBuffer == nullptr) {
+        traceBuffer = new TraceBuffer();
+        traceBuffer->threadId = ++traceThreadCount;
+        traceBuffer->openSpans = 0;
+        traceBuffer->count = 0;
+        traceBuffer->events.reset(new TraceEvent[TRACE_BUFFER_SIZE]);
+        // Push onto the list without a lock, retrying if another thread got there first.
+        traceBuffer->next = traceBuffers.load();
+        while (!traceBuffers.compare_exchange_weak(traceBuffer->next, traceBuffer)) {
+        }
+    }
+    return traceBuffer;
+}
+
+// Returns the spans still held by every thread's buffer, one list per thread in order of start.
+vector<vector<TraceEvent> > getTraceEvents() {
+    vector<vector<TraceEvent> > threads;
+    for (TraceBuffer* buffer = traceBuffers.load(); buffer != nullptr; buffer = buffer->next) {
+        unsigned long long count = buffer->count.load(memory_order_acquire);
+        unsigned long long first = count > TRACE_BUFFER_SIZE ? count - TRACE_BUFFER_SIZE : 0;
+        vector<TraceEvent> events;
+        for (unsigned long long i = first; i < count; i++) {
+            events.push_back(buffer->events[i % TRACE_BUFFER_SIZE]);
+        }
+        // Spans are recorded as they end, so put parents back in front of their children.
+        sort(events.begin(), events.end(), [](const TraceEvent& a, const TraceEvent& b) {
+            return a.start != b.start ? a.start < b.start : a.depth < b.depth;
+        });
+        threads.insert(threads.begin(), events);
+    }
+    return threads;
+}
+
+// Writes every span as Chrome trace-event JSON (chrome://tracing, Perfetto).
+void writeChromeTrace(string filename) {
+    ofstream traceFile(filename);
+    if (!traceFile.is_open()) {
+        cerr << "Unable to open " << filename << ".\n";
+        return;
+    }
+    vector<vector<TraceEvent> > threads = getTraceEvents();
+    traceFile << "{\"traceEvents\":[";
+    bool first = true;
+    for (unsigned t = 0; t < threads.size(); t++) {
+        for (auto event : threads[t]) {
+            traceFile << (first ? "\n" : ",\n");
+            traceFile << "{\"name\":\"" << event.name;
+            if (event.arg != -1) {
+                traceFile << " " << event.arg;
+            }
+            traceFile << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << t + 1 << ",\"ts\":"
+                << event.start << ",\"dur\":" << event.end - event.start << "}";
+            first = false;
+        }
+    }
+    traceFile << "\n],\"displayTimeUnit\":\"ms\"}\n";
+}
+
+// Writes the time spent in every stack of spans as folded stacks for flamegraph.pl, in
+// microseconds.
+void writeFoldedTrace(string filename) {
+    ofstream traceFile(filename);
+    if (!traceFile.is_open()) {
+        cerr << "Unable to open " << filename << ".\n";
+        return;
+    }
+    // Time spent in each stack, not counting the spans inside it.
+    map<string, long long> stacks;
+    for (auto events : getTraceEvents()) {
+        // Open spans as (stack name, event), innermost last.
+        vector<pair<string, TraceEvent> > open;
+        for (auto event : events) {
+            // Close whatever this span isn't inside of.
+            while (open.size() > 0 && (open.back().second.depth >= event.depth ||
+                    open.back().second.end < event.end)) {
+                open.pop_back();
+            }
+            string name = event.name;
+            if (event.arg != -1) {
+                name += " " + to_string(event.arg);
+            }
+            string stack = open.size() > 0 ? open.back().first + ";" + name : name;
+            long long duration = event.end - event.start;
+            stacks[stack] += duration;
+            if (open.size() > 0) {
+                stacks[open.back().first] -= duration;
+            }
+            open.push_back(make_pair(stack, event));
+        }
+    }
+    for (auto it : stacks) {
+        if (it.second > 0) {
+            traceFile << it.first << " " << it.second << "\n";
+        }
+    }
+}
+
 /**************************************************************************************************
 *                                           UTILS                                                 *
 **************************************************************************************************/
@@ -810,6 +2940,12 @@ int randomNoteKey(vector<int> noteKeys) {
     return noteKeys[randIndex];
 }
 
+// Same as above, using the given generator so threads don't share rand()'s state.
+int randomNoteKey(vector<int> noteKeys, mt19937& rng) {
+    int randIndex = rng() % noteKeys.size();
+    return noteKeys[randIndex];
+}
+
 // Get the tempo in BPM.
 int getTempo() {
     int tempo;
@@ -820,7 +2956,7 @@ int getTempo() {
 
 // Get the number of measures to be written.
 int getNumMeasures() {
-    int numMeasures;
+    int numMeasures = 0;
     cout << "Please enter the desired number of measures: ";
     cin >> numMeasures;
     return numMeasures;
@@ -829,14 +2965,231 @@ int getNumMeasures() {
 // Calculate the total amount of time in seconds of the melody.
 int calcTotalNotes(int numMeasures) {
     // 4 beats per measure * numMeasures
-    return 4 * numMeasures;
+    return NOTES_PER_MEASURE * numMeasures;
 }
 
-int main()
+// Returns the default ranges, top to bottom, for numVoices voices.
+vector<array<int, 2> > getVoiceRanges(int numVoices) {
+    vector<const int*> defaults;
+    if (numVoices >= 4) {
+        defaults.push_back(SOPRANO);
+    }
+    defaults.push_back(ALTO);
+    defaults.push_back(TENOR);
+    if (numVoices >= 3) {
+        defaults.push_back(BASS);
+    }
+
+    vector<array<int, 2> > ranges;
+    for (auto range : defaults) {
+        array<int, 2> bounds = { { range[0], range[1] } };
+        ranges.push_back(bounds);
+    }
+    return ranges;
+}
+
+// Times the two voice and n-voice solvers over runs random pieces per voice count and prints a
+// table of the results.
+void benchmarkSolvers(int runs) {
+    int totalNotes = calcTotalNotes(BENCH_MEASURES);
+    cout << "voices  solver     mean ms   max ms   failed\n";
+    // Rows 1 - 4 are the two voice solver in each species, the rest the n-voice solver.
+    for (int row = 1; row <= 7; row++) {
+        int numVoices = max(row - 3, 2);
+        vector<array<int, 2> > ranges = getVoiceRanges(numVoices);
+        double totalMs = 0;
+        double maxMs = 0;
+        int failures = 0;
+        for (int run = 0; run < runs; run++) {
+            MusicKey musicKey = lookupMusicKey(KEY_NAMES[rand() % 12] + " " +
+                MODES[rand() % NUM_MODES].name);
+            vector<map<int, int> > notes;
+            for (auto range : ranges) {
+                notes.push_back(getNotes(musicKey, range.data()));
+            }
+            vector<int> cantusNotes;
+            do {
+                cantusNotes = generateCantusMelody(notes[0], musicKey, totalNotes);
+            } while (cantusNotes.size() == 0);
+
+            // Only the solve is timed.
+            chrono::steady_clock::time_point start = chrono::steady_clock::now();
+            bool solved;
+            if (row == 1) {
+                vector<int> ctrptNotes;
+                solved = backtrackFillCtrptMelody(ctrptNotes, notes[1], musicKey,
+                    cantusNotes).back() != -1;
+            }
+            else if (row <= 4) {
+                long budget = SEARCH_NODE_BUDGET;
+                solved = fillSpeciesMelody(notes[1], musicKey, cantusNotes, row,
+                    budget).back() != -1;
+            }
+            else {
+                long budget = SEARCH_NODE_BUDGET;
+                solved = fillVoices(cantusNotes, notes, musicKey, budget).size() > 0;
+            }
+            chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+
+            totalMs += elapsed.count();
+            maxMs = max(maxMs, elapsed.count());
+            if (!solved) {
+                failures += 1;
+            }
+        }
+        string solver = row == 1 ? "original" : row <= 4 ? "species " + to_string(row) : "n-voice";
+        printf("%-7d %-10s %8.3f %8.3f %8d\n", numVoices, solver.c_str(), totalMs / runs, maxMs,
+            failures);
+    }
+}
+
+int main(int argc, char* argv[])
 {
     seedRand();
-    ofstream myfile = startFile("counterpoint.csd");
-    writeMelody(myfile);
-    endFile(myfile);
-    return 0;
+
+    // Tracing: --trace <out.json>, --trace-folded <out.txt>, --trace-depth <n>
+    string traceFile;
+    string foldedTraceFile;
+    for (int i = 1; i < argc; i++) {
+        string option = argv[i];
+        if (option == "--trace" && i + 1 < argc) {
+            traceFile = argv[++i];
+        }
+        else if (option == "--trace-folded" && i + 1 < argc) {
+            foldedTraceFile = argv[++i];
+        }
+        else if (option == "--trace-depth" && i + 1 < argc) {
+            traceDepth = atoi(argv[++i]);
+        }
+        // Tuning: --tuning <equal, just, pythagorean or meantone> [A4 Hz]
+        else if (option == "--tuning" && i + 1 < argc) {
+            tuning = getTuning(argv[++i]);
+            if (tuning == -1) {
+                cerr << "Unknown tuning " << argv[i] << ".\n";
+                return 1;
+            }
+            if (i + 1 < argc && argv[i + 1][0] != '-') {
+                tuningA4 = atof(argv[++i]);
+            }
+        }
+    }
+    tracingEnabled = traceFile != "" || foldedTraceFile != "";
+    int exitCode = 0;
+
+    // Streaming: FirstSpeciesCtrpt --stream <key> <tempo> [measures] [lookahead]
+    if (argc > 1 && string(argv[1]) == "--stream") {
+        // Anything starting with -- is another option rather than measures or lookahead.
+        bool hasMeasures = argc > 4 && string(argv[4]).compare(0, 2, "--") != 0;
+        bool hasLookahead = hasMeasures && argc > 5 && string(argv[5]).compare(0, 2, "--") != 0;
+        int tempo = argc > 3 ? atoi(argv[3]) : 0;
+        int maxMeasures = hasMeasures ? atoi(argv[4]) : 0;
+        int lookahead = hasLookahead ? atoi(argv[5]) : STREAM_LOOKAHEAD;
+        if (tempo <= 0 || maxMeasures < 0 || lookahead < 0) {
+            cerr << "Usage: " << argv[0] << " --stream <key> <tempo> [measures] [lookahead]\n";
+            return 1;
+        }
+        MusicKey musicKey = lookupMusicKey(argv[2]);
+        if (musicKey.tonic == -1) {
+            return 1;
+        }
+        writeStreamFile("stream.csd");
+        cerr << "Streaming to stdout, press Enter to cadence.\n";
+        streamMelody(musicKey, tempo, maxMeasures, lookahead);
+    }
+    // Benchmark: FirstSpeciesCtrpt --bench [runs]
+    else if (argc > 1 && string(argv[1]) == "--bench") {
+        benchmarkSolvers(argc > 2 && argv[2][0] != '-' ? atoi(argv[2]) : 100);
+    }
+    // Batch: FirstSpeciesCtrpt --batch <count> <key> <measures> <tempo> [threads] [stop estimate]
+    else if (argc > 1 && string(argv[1]) == "--batch") {
+        if (argc < 6) {
+            cerr << "Usage: " << argv[0]
+                << " --batch <count> <key> <measures> <tempo> [threads] [stop estimate]\n";
+            return 1;
+        }
+        MusicKey musicKey = lookupMusicKey(argv[3]);
+        if (musicKey.tonic == -1) {
+            return 1;
+        }
+        bool hasThreads = argc > 6 && argv[6][0] != '-';
+        int numThreads = hasThreads ? atoi(argv[6]) : 0;
+        if (numThreads <= 0) {
+            numThreads = max((int)thread::hardware_concurrency(), 1);
+        }
+        double stopEstimate = hasThreads && argc > 7 && argv[7][0] != '-' ? atof(argv[7]) :
+            BATCH_STOP_ESTIMATE;
+        int count = atoi(argv[2]);
+        int numMeasures = atoi(argv[4]);
+        int tempo = atoi(argv[5]);
+        if (count <= 0 || numMeasures <= 0 || tempo <= 0) {
+            cerr << "Usage: " << argv[0]
+                << " --batch <count> <key> <measures> <tempo> [threads] [stop estimate]\n";
+            return 1;
+        }
+        writeBatch(count, musicKey, numMeasures, tempo, numThreads, stopEstimate);
+    }
+    // Verification: FirstSpeciesCtrpt --verify [iterations] [seed]
+    else if (argc > 1 && string(argv[1]) == "--verify") {
+        int iterations = argc > 2 && argv[2][0] != '-' ? atoi(argv[2]) : 10000;
+        unsigned seed = argc > 3 && argv[3][0] != '-' ? strtoul(argv[3], NULL, 10) :
+            (unsigned)time(0);
+        if (!verifySolvers(iterations, seed)) {
+            exitCode = 1;
+        }
+    }
+    else {
+        for (int i = 1; i < argc; i++) {
+            string option = argv[i];
+            // Parallel solve: --threads <n>, 0 for one per core.
+            if (option == "--threads" && i + 1 < argc) {
+                solverThreads = atoi(argv[++i]);
+                if (solverThreads <= 0) {
+                    solverThreads = thread::hardware_concurrency();
+                }
+            }
+            // Higher species: --species <1 - 4>
+            else if (option == "--species" && i + 1 < argc) {
+                char* end;
+                long species = strtol(argv[++i], &end, 10);
+                if (*end != '\0' || species < 1 || species > 4) {
+                    cerr << "Usage: " << argv[0] << " --species <1 - 4>\n";
+                    return 1;
+                }
+                ctrptSpecies = species;
+            }
+            // N-voice solve: --voices <n> [<low MIDI> <high MIDI>]..., ranges from top to bottom.
+            else if (option == "--voices" && i + 1 < argc) {
+                char* end;
+                long numVoices = strtol(argv[++i], &end, 10);
+                if (*end != '\0' || numVoices < 2 || numVoices > MAX_VOICES) {
+                    cerr << "Usage: " << argv[0] << " --voices <2 - " << MAX_VOICES
+                        << "> [<low MIDI> <high MIDI>]...\n";
+                    return 1;
+                }
+                voiceRanges = getVoiceRanges(numVoices);
+                for (unsigned v = 0; v < voiceRanges.size() && i + 2 < argc && argv[i + 1][0] != '-'; v++) {
+                    voiceRanges[v][0] = atoi(argv[++i]);
+                    voiceRanges[v][1] = atoi(argv[++i]);
+                    if (voiceRanges[v][0] < MIDI_LOWEST || voiceRanges[v][1] > MIDI_HIGHEST ||
+                            voiceRanges[v][0] > voiceRanges[v][1]) {
+                        cerr << "Voice ranges must be <low MIDI> <high MIDI> with " << MIDI_LOWEST
+                            << " <= low <= high <= " << MIDI_HIGHEST << ".\n";
+                        return 1;
+                    }
+                }
+            }
+        }
+
+        ofstream myfile = startFile("counterpoint.csd", "-odac", max((int)voiceRanges.size(), 2));
+        writeMelody(myfile);
+        endFile(myfile);
+    }
+
+    if (traceFile != "") {
+        writeChromeTrace(traceFile);
+    }
+    if (foldedTraceFile != "") {
+        writeFoldedTrace(foldedTraceFile);
+    }
+    return exitCode;
 }